@@ -0,0 +1,68 @@
+/*
+ *  Polled driver for the GXemul "disk" device: one 512 byte sector at a
+ *  time goes through the device buffer.
+ */
+
+#include "dev_disk.h"
+
+/*  Same sign-extension trick as the console driver.  */
+#define	PHYSADDR_OFFSET		((signed int)0x80000000)
+
+#define	DISK_REG(off)		(PHYSADDR_OFFSET + DEV_DISK_ADDRESS + (off))
+
+
+static int ide_start(unsigned int diskno, unsigned int secno, int op)
+{
+	*((volatile unsigned int *) DISK_REG(DEV_DISK_OFFSET)) =
+		secno * DEV_DISK_BUFFER_LEN;
+	*((volatile unsigned int *) DISK_REG(DEV_DISK_OFFSET_HIGH32)) = 0;
+	*((volatile unsigned int *) DISK_REG(DEV_DISK_ID)) = diskno;
+	*((volatile unsigned int *) DISK_REG(DEV_DISK_START_OPERATION)) = op;
+
+	/*  0 means the operation failed (no such disk or sector).  */
+	return *((volatile unsigned int *) DISK_REG(DEV_DISK_STATUS)) ? 0 : -1;
+}
+
+
+/*
+ *  Read `nsecs` sectors starting at sector `secno` of disk `diskno` into
+ *  `dst`. Return 0 on success, -1 on error.
+ */
+int ide_read(unsigned int diskno, unsigned int secno, void *dst,
+	     unsigned int nsecs)
+{
+	volatile unsigned int *buf =
+		(volatile unsigned int *) DISK_REG(DEV_DISK_BUFFER);
+	unsigned int *p = dst;
+	unsigned int i, j;
+
+	for (i = 0; i < nsecs; i++) {
+		if (ide_start(diskno, secno + i, DEV_DISK_OPERATION_READ) < 0)
+			return -1;
+		for (j = 0; j < DEV_DISK_BUFFER_LEN / 4; j++)
+			*p++ = buf[j];
+	}
+	return 0;
+}
+
+
+/*
+ *  Write `nsecs` sectors from `src` to disk `diskno`, starting at sector
+ *  `secno`. Return 0 on success, -1 on error.
+ */
+int ide_write(unsigned int diskno, unsigned int secno, const void *src,
+	      unsigned int nsecs)
+{
+	volatile unsigned int *buf =
+		(volatile unsigned int *) DISK_REG(DEV_DISK_BUFFER);
+	const unsigned int *p = src;
+	unsigned int i, j;
+
+	for (i = 0; i < nsecs; i++) {
+		for (j = 0; j < DEV_DISK_BUFFER_LEN / 4; j++)
+			buf[j] = *p++;
+		if (ide_start(diskno, secno + i, DEV_DISK_OPERATION_WRITE) < 0)
+			return -1;
+	}
+	return 0;
+}
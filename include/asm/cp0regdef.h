@@ -37,6 +37,7 @@
 #define CP0_ERROREPC $30
 
 
+#define STATUSF_IP2 0x0400
 #define STATUSF_IP4 0x1000
 #define STATUS_CU0 0x10000000
 #define	STATUS_KUC 0x2
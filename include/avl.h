@@ -0,0 +1,35 @@
+#ifndef _AVL_H_
+#define _AVL_H_
+
+#include "types.h"
+
+/* An AVL tree whose nodes are embedded in the objects they order, like the
+ * links of queue.h. Equal keys keep their insertion order. */
+struct Avl_node {
+	struct Avl_node *an_left;
+	struct Avl_node *an_right;
+	struct Avl_node *an_parent;
+	int an_height;			// 0 while the node is in no tree
+};
+
+struct Avl_tree {
+	struct Avl_node *at_root;
+	struct Avl_node *at_first;	// leftmost node, kept up to date
+	int (*at_cmp)(struct Avl_node *, struct Avl_node *);
+};
+
+/* The object of type `type` whose member `field` is the node `node`. */
+#define AVL_ENTRY(node, type, field) \
+	((type *)((char *)(node) - offsetof(type, field)))
+
+#define avl_first(tree)		((tree)->at_first)
+#define avl_empty(tree)		((tree)->at_root == NULL)
+#define avl_linked(node)	((node)->an_height != 0)
+
+void avl_init(struct Avl_tree *tree,
+			  int (*cmp)(struct Avl_node *, struct Avl_node *));
+void avl_insert(struct Avl_tree *tree, struct Avl_node *node);
+void avl_remove(struct Avl_tree *tree, struct Avl_node *node);
+struct Avl_node *avl_next(struct Avl_node *node);
+
+#endif /* _AVL_H_ */
@@ -0,0 +1,37 @@
+#ifndef _BITOPS_H_
+#define _BITOPS_H_
+
+#include "types.h"
+
+/* The R3000 has no count-leading-zeros instruction, so both helpers do a
+ * five step binary search over the word instead. */
+
+/* Index of the lowest set bit of `x`, x must not be 0. */
+static inline int
+ffs32(u_int x)
+{
+	int n = 0;
+
+	if ((x & 0xffff) == 0) { n += 16; x >>= 16; }
+	if ((x & 0x00ff) == 0) { n += 8;  x >>= 8;  }
+	if ((x & 0x000f) == 0) { n += 4;  x >>= 4;  }
+	if ((x & 0x0003) == 0) { n += 2;  x >>= 2;  }
+	if ((x & 0x0001) == 0) { n += 1; }
+	return n;
+}
+
+/* Index of the highest set bit of `x`, x must not be 0. */
+static inline int
+fls32(u_int x)
+{
+	int n = 31;
+
+	if ((x & 0xffff0000) == 0) { n -= 16; x <<= 16; }
+	if ((x & 0xff000000) == 0) { n -= 8;  x <<= 8;  }
+	if ((x & 0xf0000000) == 0) { n -= 4;  x <<= 4;  }
+	if ((x & 0xc0000000) == 0) { n -= 2;  x <<= 2;  }
+	if ((x & 0x80000000) == 0) { n -= 1; }
+	return n;
+}
+
+#endif /* _BITOPS_H_ */
@@ -0,0 +1,16 @@
+#ifndef _CONS_H_
+#define _CONS_H_
+
+#include "types.h"
+
+/* Characters typed but not read yet. */
+#define CONS_BUFSIZE	128
+
+struct Wait_queue;
+extern struct Wait_queue cons_wait;
+
+void cons_init(void);
+void cons_intr(void);
+int cons_getc(void);
+
+#endif /* _CONS_H_ */
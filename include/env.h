@@ -7,18 +7,47 @@
 #include "queue.h"
 #include "trap.h"
 #include "mmu.h" 
+#include "avl.h"
 
 #define LOG2NENV	10
 #define NENV		(1<<LOG2NENV)
 #define ENVX(envid)	((envid) & (NENV - 1)) 
 /*envid & 11_1111_1111 即 envid的后10位，因为首位有个1*/
-#define GET_ENV_ASID(envid) (((envid)>> 11)<<6)
 
 // Values of env_status in struct Env
 #define ENV_FREE	0
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
 
+// A PT_LOAD segment of the program image, loaded page by page on first touch
+#define ENV_NSEG	4
+
+struct Env_seg {
+	u_long sg_va;			// where the segment starts in memory
+	u_int sg_memsz;			// its size in memory
+	u_char *sg_bin;			// its bytes in the (kernel-resident) image
+	u_int sg_filesz;		// how many bytes of it come from the image
+	u_int sg_flags;			// PF_* flags
+};
+
+/* What an env has cost the memory system so far, see sys_env_stats.
+ * es_refills must stay first: handle_tlb bumps it through curenv_stats. */
+struct Env_stats {
+	u_int es_refills;		// TLB refills
+	u_int es_zero_faults;		// first touches of anonymous memory (pageout)
+	u_int es_mod_faults;		// writes to read-only pages (page_fault_handler)
+	u_int es_cow_faults;		// ... of which copy-on-write, resolved by the kernel
+	u_int es_pages;			// pages allocated while it ran
+	u_int es_pagein;		// program image pages faulted in (env_load_page)
+};
+
+TAILQ_HEAD(Env_tailq, Env);
+
+/* Envs blocked until something happens, see wq_wait. */
+struct Wait_queue {
+	struct Env_tailq wq_envs;
+};
+
 struct Env {
 	struct Trapframe env_tf;        // Saved registers
 	LIST_ENTRY(Env) env_link;       // Free list 
@@ -38,16 +67,24 @@ struct Env {
 	/* 进程页目录的虚拟地址。*/
 	u_int env_cr3;
 	/* 进程页目录的物理地址。*/
-	LIST_ENTRY(Env) env_sched_link;
-	/* 来构造就绪状态进程链表。*/
+	TAILQ_ENTRY(Env) env_sched_link;
+	/* 来构造就绪状态进程链表（每个优先级一条，见 lib/sched.c）；
+	   阻塞时则用来挂在等待队列上。*/
+	struct Env_tailq *env_rq;	// the SCHED_RR queue it is on, or NULL
+	struct Wait_queue *env_wq;	// the wait queue it is blocked on, or NULL
     u_int env_pri;
-    /* 进程的优先级。*/
+    /* 进程的优先级，也是它一次能运行的时间片数。*/
+	u_int env_slice;		// microseconds left in its time slice (SCHED_RR)
+	u_int env_vruntime;		// weighted run time, SCHED_FAIR only
+	struct Avl_node env_fair_node;	// in the SCHED_FAIR tree, by env_vruntime
 	// Lab 4 IPC
 	u_int env_ipc_value;            // data value sent to us 
 	u_int env_ipc_from;             // envid of the sender  
 	u_int env_ipc_recving;          // env is blocked receiving
 	u_int env_ipc_dstva;		// va at which to map received page
 	u_int env_ipc_perm;		// perm of page mapping received
+	struct Wait_queue env_ipc_wait;	// this env, blocked in sys_ipc_recv
+	struct Wait_queue env_ipc_senders;	// envs waiting for it to receive
 
 	// Lab 4 fault handling
 	u_int env_pgfault_handler;      // page fault state
@@ -56,19 +93,30 @@ struct Env {
 	// Lab 6 scheduler counts
 	u_int env_runs;			// number of times been env_run'ed
 	u_int env_nop;                  // align to avoid mul instruction
+
+	// Demand loading of the program image
+	u_char *env_bin;		// the program image, which stays in kernel memory
+	u_int env_binsize;
+	struct Env_seg env_seg[ENV_NSEG];	// segments left to pageout
+	u_int env_nseg;
+
+	struct Env_stats env_stats;
 };
 
 LIST_HEAD(Env_list, Env);
 extern struct Env *envs;		// All environments
 extern struct Env *curenv;	        // the current env
-extern struct Env_list env_sched_list[2]; // runnable env list
+extern int env_lazy_load;		// load program images on first touch
+extern struct Env_stats *curenv_stats;	// &curenv->env_stats, or the kernel's
 
 void env_init(void);
-innenv_alloc(struct Env **e, u_int parent_id);
+int env_alloc(struct Env **e, u_int parent_id);
 void env_free(struct Env *);
 void env_create_priority(u_char *binary, int size, int priority);
 void env_create(u_char *binary, int size);
 void env_destroy(struct Env *e);
+void env_suspend(struct Trapframe *tf);
+int env_load_page(struct Env *e, u_long va);
 
 int envid2env(u_int envid, struct Env **penv, int checkperm);
 void env_run(struct Env *e);
@@ -2,9 +2,23 @@
 
 #ifndef _KCLOCK_H_
 #define _KCLOCK_H_
-#define	IO_RTC		0xb5000100		/* RTC port */
+#define	IO_RTC		0xb5000100		/* RTC port: interrupts per second, 0 for none */
+#define	IO_RTC_ACK	0xb5000110		/* write to acknowledge the interrupt */
+
+/* The periodic tick set_timer starts with, and its length. */
+#define	KCLOCK_HZ	1
+#define	KCLOCK_TICK_USEC	(1000000 / KCLOCK_HZ)
+
+/* GXemul RTC: writing IO_RTC_TRIGGER latches the current time, which can
+ * then be read back from IO_RTC_SEC and IO_RTC_USEC. */
+#define	IO_RTC_TRIGGER	0xb5000000
+#define	IO_RTC_SEC	0xb5000010
+#define	IO_RTC_USEC	0xb5000020
 #ifndef __ASSEMBLER__
 void kclock_init(void);
+u_int kclock_usec(void);
+void kclock_set_hz(u_int hz);
+void kclock_ack(void);
 #endif /* !__ASSEMBLER__ */
 #endif
 
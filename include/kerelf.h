@@ -130,6 +130,7 @@ typedef struct {
 
 int load_elf(u_char *binary, int size,
 			 u_long *entry_point, void *user_data,
-			 int (*map)(u_long, u_int32_t, u_char *, u_int32_t, void *));
+			 int (*map)(u_long, u_int32_t, u_char *, u_int32_t, u_int32_t,
+						void *));
 
 #endif /* kerelf.h */
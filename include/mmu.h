@@ -43,6 +43,7 @@
 #define PTE_COW		0x0001	// Copy On Write
 #define PTE_UC		0x0800	// unCached
 #define PTE_LIBRARY		0x0004	// share memmory
+#define PTE_SWAP	0x0010	// page is on the swap disk, the PFN field holds its slot (software bit, PTE_V clear)
 /*
  * Part 2.  Our conventions.
  */
@@ -181,6 +182,9 @@ extern volatile Pde *vpd[];
 
 
 extern void tlb_out(u_int entryhi);
+extern void tlb_flush_asid(u_int asid);
+extern void tlb_flush_all(void);
+extern int tlb_probe(u_int entryhi);
 
 #endif //!__ASSEMBLER__
 #endif // !_MMU_H_
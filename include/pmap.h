@@ -7,9 +7,26 @@
 #include "printf.h"
 
 
+struct Rmap;
+
 LIST_HEAD(Page_list, Page);
 typedef LIST_ENTRY(Page) Page_LIST_entry_t;
 
+/* Buddy allocator: blocks of 2^order pages, order 0 (4KB) .. 10 (4MB, PDMAP). */
+#define PAGE_MAX_ORDER	11
+
+// Values of pp_flags in struct Page
+#define PG_FREE		0x01	// head of a block sitting on a buddy free list
+#define PG_ZERO		0x02	// page sits in the pre-zeroed pool, known all zero
+#define PG_RESERVED	0x04	// never given back to the allocator (kernel memory, zero_page)
+
+// Flags for page_alloc_flags
+#define PA_ZERO		0x01	// caller needs a cleared page (the default)
+#define PA_NOZERO	0x02	// caller overwrites the whole page, skip the clear
+
+/* At most this many pages are kept cleared ahead of time by page_zero_idle. */
+#define PAGE_ZERO_POOL_MAX	64
+
 struct Page {
 	Page_LIST_entry_t pp_link;	/* free list link */
 
@@ -19,9 +36,50 @@ struct Page {
 	// do not have valid reference count fields.
 
 	u_short pp_ref;
+
+	// Order of the block this page heads, only valid for the first page
+	// of a free block or of a block returned by page_alloc_order.
+	u_char pp_order;
+	u_char pp_flags;
+
+	// Who maps this page, see mm/rmap.c.
+	struct Rmap *pp_rmap;
+};
+
+/* Snapshot of the physical page allocator, filled in by page_stats. */
+struct Page_stats {
+	u_long ps_total;	// pages managed by the allocator (npage)
+	u_long ps_free;		// free pages, including the two below
+	u_long ps_zeroed;	// free pages sitting in the pre-zeroed pool
+	u_long ps_uncarved;	// free pages not handed to the buddy lists yet
+	u_long ps_blocks[PAGE_MAX_ORDER];	// free blocks on each buddy list
+};
+
+/* TLB entries to drop queued per address space before one flush of its
+ * whole ASID is cheaper (see tlb_invalidate). */
+#define PGDIR_INVAL_MAX	16
+
+/* Every page directory is an order-1 block: the directory itself, then
+ * this bookkeeping page about it. */
+struct Pgdir_info {
+	u_int pi_pdemap[1024 / 32];	// directory entries holding a page table
+	u_short pi_count[1024];		// valid or PTE_SWAP PTEs in each page table
+	u_int pi_asid;			// ASID, in its EntryHi position (see pgdir_asid)
+	u_int pi_asid_gen;		// the ASID generation pi_asid belongs to
+	u_int pi_batch;			// nesting depth of tlb_batch_begin
+	u_int pi_ninval;		// queued entries, > PGDIR_INVAL_MAX: flush the ASID
+	u_long pi_inval[PGDIR_INVAL_MAX];	// queued virtual addresses
+};
+
+/* What deferring TLB invalidations saved, filled in by tlb_stats. */
+struct Tlb_stats {
+	u_long ts_requests;	// entries that had to go (tlb_invalidate calls)
+	u_long ts_probes;	// tlb_out probes actually run for them
+	u_long ts_asid_flushes;	// queues that flushed their whole ASID instead
 };
 
 extern struct Page *pages;
+extern struct Page *zero_page;
 static inline u_long
 page2ppn(struct Page *pp)
 {
@@ -62,6 +120,11 @@ va2pa(Pde *pgdir, u_long va)
 		return ~0;
 	return PTE_ADDR(p[PTX(va)]);
 }
+static inline struct Pgdir_info *
+pgdir_info(Pde *pgdir)
+{
+	return (struct Pgdir_info *)((u_long)pgdir + BY2PG);
+}
 
 void mips_detect_memory();
 
@@ -70,14 +133,36 @@ void mips_vm_init();
 void mips_init();
 void page_init(void);
 void page_check();
+void buddy_check(void);
+void page_fork_check(void);
+void tlb_refill_bench(void);
 int page_alloc(struct Page **pp);
+int page_alloc_flags(struct Page **pp, int flags);
+int page_zero_idle(int budget);
+u_long page_free_count(void);
+u_long page_next_free(u_long ppn);
+void page_stats(struct Page_stats *st);
+int page_alloc_order(u_int order, struct Page **pp);
 void page_free(struct Page *pp);
+void page_free_order(struct Page *pp, u_int order);
 void page_decref(struct Page *pp);
 int pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte);
 int page_insert(Pde *pgdir, struct Page *pp, u_long va, u_int perm);
 struct Page* page_lookup(Pde *pgdir, u_long va, Pte **ppte);
 void page_remove(Pde *pgdir, u_long va) ;
+u_int pgdir_next_table(Pde *pgdir, u_int pdx);
+int page_map_range(Pde *pgdir, u_long va, struct Page **pages, u_int n, u_int perm);
+void page_unmap_range(Pde *pgdir, u_long va, u_long len);
 void tlb_invalidate(Pde *pgdir, u_long va);
+u_int pgdir_asid(Pde *pgdir);
+void tlb_batch_begin(Pde *pgdir);
+void tlb_batch_end(Pde *pgdir);
+void tlb_flush_pending(Pde *pgdir);
+int tlb_test_and_clear(Pde *pgdir, u_long va);
+void tlb_stats(struct Tlb_stats *st);
+int page_cow_fault(Pde *pgdir, u_long va);
+int page_fork(Pde *src, Pde *dst);
+void pageout(int va, int context, u_int cause);
 
 void boot_map_segment(Pde *pgdir, u_long va, u_long size, u_long pa, int perm);
 
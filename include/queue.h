@@ -255,6 +255,51 @@ void lp_Print(void (*output)(void *, char *, int),
                 struct type **tqe_prev; /* address of previous next element */  \
         }
 
+/*
+ * Tail queue functions.
+ */
+#define TAILQ_EMPTY(head)       ((head)->tqh_first == NULL)
+
+#define TAILQ_FIRST(head)       ((head)->tqh_first)
+
+#define TAILQ_NEXT(elm, field)  ((elm)->field.tqe_next)
+
+#define TAILQ_FOREACH(var, head, field)                                 \
+        for ((var) = TAILQ_FIRST((head));                               \
+             (var);                                                     \
+             (var) = TAILQ_NEXT((var), field))
+
+#define TAILQ_INIT(head) do {                                           \
+                TAILQ_FIRST((head)) = NULL;                             \
+                (head)->tqh_last = &TAILQ_FIRST((head));                \
+        } while (0)
+
+#define TAILQ_INSERT_HEAD(head, elm, field) do {                        \
+                if ((TAILQ_NEXT((elm), field) = TAILQ_FIRST((head))) != NULL)  \
+                        TAILQ_FIRST((head))->field.tqe_prev =           \
+                                &TAILQ_NEXT((elm), field);              \
+                else                                                    \
+                        (head)->tqh_last = &TAILQ_NEXT((elm), field);   \
+                TAILQ_FIRST((head)) = (elm);                            \
+                (elm)->field.tqe_prev = &TAILQ_FIRST((head));           \
+        } while (0)
+
+#define TAILQ_INSERT_TAIL(head, elm, field) do {                        \
+                TAILQ_NEXT((elm), field) = NULL;                        \
+                (elm)->field.tqe_prev = (head)->tqh_last;               \
+                *(head)->tqh_last = (elm);                              \
+                (head)->tqh_last = &TAILQ_NEXT((elm), field);           \
+        } while (0)
+
+#define TAILQ_REMOVE(head, elm, field) do {                             \
+                if ((TAILQ_NEXT((elm), field)) != NULL)                 \
+                        TAILQ_NEXT((elm), field)->field.tqe_prev =      \
+                                (elm)->field.tqe_prev;                  \
+                else                                                    \
+                        (head)->tqh_last = (elm)->field.tqe_prev;       \
+                *(elm)->field.tqe_prev = TAILQ_NEXT((elm), field);      \
+        } while (0)
+
 
 #endif  /* !_SYS_QUEUE_H_ */
 
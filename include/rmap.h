@@ -0,0 +1,25 @@
+#ifndef _RMAP_H_
+#define _RMAP_H_
+
+#include "types.h"
+#include "mmu.h"
+
+struct Page;
+
+/* One mapping of a page: `rm_va` in the address space `rm_pgdir`. The
+ * mappings of a page are chained from its pp_rmap. */
+struct Rmap {
+	struct Rmap *rm_next;
+	Pde *rm_pgdir;
+	u_long rm_va;
+};
+
+void rmap_init(void);
+int rmap_add(struct Page *pp, Pde *pgdir, u_long va);
+void rmap_del(struct Page *pp, Pde *pgdir, u_long va);
+int rmap_for_each(struct Page *pp,
+				  int (*fn)(struct Page *pp, Pde *pgdir, u_long va, void *arg),
+				  void *arg);
+void rmap_report(void);
+
+#endif /* _RMAP_H_ */
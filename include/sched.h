@@ -3,8 +3,32 @@
 #ifndef __SCHED_H__
 #define __SCHED_H__
 
+struct Env;
+struct Wait_queue;
+
+/* Priority levels. A higher env_pri runs first (SCHED_RR) or weighs
+ * more (SCHED_FAIR); anything above the top level shares it. */
+#define SCHED_NPRI	32
+
+/* Values of sched_policy, which must be set before sched_init. SCHED_RR
+ * is the default; mips_init may pick SCHED_FAIR instead. */
+#define SCHED_RR	0	// priority run queues, env_pri ticks at a time
+#define SCHED_FAIR	1	// least weighted run time first
+
+extern int sched_policy;
+
 void sched_init(void);
 void sched_yield(void);
 void sched_intr(int); 
+void sched_tick(void);
+
+void wq_init(struct Wait_queue *q);
+void wq_wait(struct Wait_queue *q);
+void wq_wake_one(struct Wait_queue *q);
+void wq_wake_all(struct Wait_queue *q);
+void wq_remove(struct Env *e);
+void sched_insert(struct Env *e);
+void sched_remove(struct Env *e);
+void sched_check(void);
 
-#endif /* __SCHED_H__ */
\ No newline at end of file
+#endif /* __SCHED_H__ */
@@ -0,0 +1,44 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include "types.h"
+#include "queue.h"
+
+/* Most object caches the kernel can create. */
+#define KMEM_CACHE_MAX		16
+
+/* Free slabs a cache keeps around before handing pages back to page_free. */
+#define KMEM_EMPTY_KEEP		1
+
+LIST_HEAD(Slab_list, Slab);
+
+/* One page worth of objects. The header sits at the start of the page and
+ * free objects are chained through their first word. */
+struct Slab {
+	LIST_ENTRY(Slab) sl_link;	// on the cache's partial/full/empty list
+	struct Kmem_cache *sl_cache;	// cache this slab belongs to
+	void *sl_free;			// first free object
+	u_int sl_inuse;			// objects handed out
+};
+
+struct Kmem_cache {
+	u_int kc_size;			// object size, rounded up to kc_align
+	u_int kc_align;
+	u_int kc_offset;		// offset of the first object in a slab
+	u_int kc_per_slab;		// objects in one slab
+	struct Slab_list kc_partial;	// slabs with both used and free objects
+	struct Slab_list kc_full;	// slabs with no free object
+	struct Slab_list kc_empty;	// slabs with no used object
+	u_int kc_nslabs;		// slabs currently owned
+	u_int kc_nempty;		// of which on kc_empty
+	u_int kc_inuse;			// objects handed out
+};
+
+struct Kmem_cache *kmem_cache_create(u_int size, u_int align);
+void *kmem_cache_alloc(struct Kmem_cache *cache);
+void kmem_cache_free(struct Kmem_cache *cache, void *obj);
+void kmem_cache_destroy(struct Kmem_cache *cache);
+void kmem_cache_dump(void);
+void kmem_cache_check(void);
+
+#endif /* _SLAB_H_ */
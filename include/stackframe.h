@@ -2,6 +2,7 @@
 #include <asm/cp0regdef.h>
 #include <asm/asm.h>
 #include <trap.h>
+#include <mmu.h>
 
 .macro STI
 	mfc0	t0,	CP0_STATUS
@@ -157,7 +158,7 @@
 	xori	k1, 0x1000
 	bnez	k1, 1f
 	nop
-	li	sp, 0x82000000
+	li	sp, TIMESTACK
 	j	2f
 	nop
 1:
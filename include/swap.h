@@ -0,0 +1,37 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include "types.h"
+#include "mmu.h"
+
+struct Page;
+
+/* The swap area: the first SWAP_NSLOTS pages of GXemul disk SWAP_DISKNO
+ * (run gxemul with `-d swap.img`, an image of at least 4MB). */
+#define SWAP_DISKNO		0
+#define SWAP_NSLOTS		1024
+#define SECT_SIZE		512
+#define SECT2PG			(BY2PG / SECT_SIZE)
+
+/* Slot number of the page a PTE_SWAP entry refers to. */
+#define SWAP_SLOT(pte)		PPN(pte)
+
+struct Swap_stats {
+	u_int ss_used;			// slots holding a page
+	u_int ss_outs;			// pages written out
+	u_int ss_ins;			// pages read back
+	u_int ss_scans;			// pages looked at by the clock hand
+};
+
+int ide_read(u_int diskno, u_int secno, void *dst, u_int nsecs);
+int ide_write(u_int diskno, u_int secno, const void *src, u_int nsecs);
+
+void swap_init(void);
+int swap_out_one(void);
+int swap_in(Pde *pgdir, u_long va);
+void swap_drop(Pte pte);
+int swap_page_alloc(struct Page **pp, int flags);
+void swap_stats(struct Swap_stats *st);
+void swap_check(void);
+
+#endif /* _SWAP_H_ */
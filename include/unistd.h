@@ -2,7 +2,7 @@
 #define UNISTD_H
 
 #define __SYSCALL_BASE 9527
-#define __NR_SYSCALLS 20
+#define __NR_SYSCALLS 17
 
 
 #define SYS_putchar 		((__SYSCALL_BASE ) + (0 ) ) 
@@ -20,4 +20,6 @@
 #define SYS_ipc_can_send		((__SYSCALL_BASE ) + (12 ) )
 #define SYS_ipc_recv		((__SYSCALL_BASE ) + (13 ) )
 #define SYS_cgetc			((__SYSCALL_BASE ) + (14 ) )
+#define SYS_env_fork		((__SYSCALL_BASE ) + (15 ) )
+#define SYS_env_stats		((__SYSCALL_BASE ) + (16 ) )
 #endif
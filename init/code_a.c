@@ -1,4 +1,5 @@
-unsigned char binary_user_A_start[] = {
+/* Page aligned, so load_icode can map its read-only pages in place. */
+unsigned char binary_user_A_start[] __attribute__((aligned(4096))) = {
 0x7f,0x45,0x4c,0x46,0x1,0x2,0x1,0x0,0x0,0x0,0x0,0x0,0x0,0x0,0x0,0x0,0x0,0x2,0x0,0x8,0x0,0x0,0x0,0x1,0x0,0x40,0x0,0xb0,0x0,0x0,0x0,0x34,0x0,0x0,0xf,0xb0,0x50,0x0,0x10,0x1,0x0,
 0x34,0x0,0x20,0x0,0x3,0x0,0x28,0x0,0xd,0x0,0xa,0x70,0x0,0x0,0x0,0x0,0x0,0x0,0x94,0x0,0x40,0x0,0x94,0x0,0x40,0x0,0x94,0x0,0x0,0x0,0x18,0x0,0x0,0x0,0x18,0x0,0x0,0x0,0x4,0x0,
 0x0,0x0,0x4,0x0,0x0,0x0,0x1,0x0,0x0,0x0,0x94,0x0,0x40,0x0,0x94,0x0,0x40,0x0,0x94,0x0,0x0,0xc,0xb2,0x0,0x0,0xc,0xb2,0x0,0x0,0x0,0x5,0x0,0x0,0x0,0x10,0x0,0x0,0x0,0x1,0x0,
@@ -4,17 +4,34 @@
 #include <printf.h>
 #include <kclock.h>
 #include <trap.h>
+#include <sched.h>
+#include <cons.h>
+#include <swap.h>
+#include <slab.h>
+#include <rmap.h>
 
 void mips_init()
 {
+	u_int t;
+
 	printf("init.c:\tmips_init() is called\n");
 	mips_detect_memory();
 	
+	t = kclock_usec();
 	mips_vm_init();
 	page_init();
+	printf("init.c:\tmemory init took %d us\n", kclock_usec() - t);
+	buddy_check();
+	kmem_cache_check();
+	swap_init();
 	
 	env_init();
+	sched_init();
+	cons_init();
 	env_check();
+	page_fork_check();
+	swap_check();
+	sched_check();
 
 	/*you can create some processes(env) here. in terms of binary code, please refer current directory/code_a.c
 	 * code_b.c*/
@@ -23,8 +40,12 @@ void mips_init()
 
 	ENV_CREATE_PRIORITY(user_A, 2);
 	ENV_CREATE_PRIORITY(user_B, 1);
+	rmap_report();
 	
 	trap_init();
+#ifdef TLB_BENCH
+	tlb_refill_bench();
+#endif
 	kclock_init();
 	panic("^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^");
 	while(1);
@@ -0,0 +1,181 @@
+#include <avl.h>
+
+static int avl_height(struct Avl_node *n)
+{
+	return n ? n->an_height : 0;
+}
+
+static void avl_update(struct Avl_node *n)
+{
+	int l = avl_height(n->an_left);
+	int r = avl_height(n->an_right);
+
+	n->an_height = (l > r ? l : r) + 1;
+}
+
+/* Make `new` take the place of `old` under `parent` (or as the root). */
+static void avl_replace(struct Avl_tree *tree, struct Avl_node *parent,
+						struct Avl_node *old, struct Avl_node *new)
+{
+	if (parent == NULL) {
+		tree->at_root = new;
+	} else if (parent->an_left == old) {
+		parent->an_left = new;
+	} else {
+		parent->an_right = new;
+	}
+}
+
+static struct Avl_node *avl_rotate_left(struct Avl_tree *tree, struct Avl_node *x)
+{
+	struct Avl_node *y = x->an_right;
+
+	x->an_right = y->an_left;
+	if (y->an_left) {
+		y->an_left->an_parent = x;
+	}
+	y->an_parent = x->an_parent;
+	avl_replace(tree, x->an_parent, x, y);
+	y->an_left = x;
+	x->an_parent = y;
+	avl_update(x);
+	avl_update(y);
+	return y;
+}
+
+static struct Avl_node *avl_rotate_right(struct Avl_tree *tree, struct Avl_node *x)
+{
+	struct Avl_node *y = x->an_left;
+
+	x->an_left = y->an_right;
+	if (y->an_right) {
+		y->an_right->an_parent = x;
+	}
+	y->an_parent = x->an_parent;
+	avl_replace(tree, x->an_parent, x, y);
+	y->an_right = x;
+	x->an_parent = y;
+	avl_update(x);
+	avl_update(y);
+	return y;
+}
+
+/* Fix heights and balance on the way from `n` up to the root. */
+static void avl_rebalance(struct Avl_tree *tree, struct Avl_node *n)
+{
+	int bal;
+
+	for (; n != NULL; n = n->an_parent) {
+		avl_update(n);
+		bal = avl_height(n->an_left) - avl_height(n->an_right);
+		if (bal > 1) {
+			if (avl_height(n->an_left->an_left) < avl_height(n->an_left->an_right)) {
+				avl_rotate_left(tree, n->an_left);
+			}
+			n = avl_rotate_right(tree, n);
+		} else if (bal < -1) {
+			if (avl_height(n->an_right->an_right) < avl_height(n->an_right->an_left)) {
+				avl_rotate_right(tree, n->an_right);
+			}
+			n = avl_rotate_left(tree, n);
+		}
+	}
+}
+
+void avl_init(struct Avl_tree *tree,
+			  int (*cmp)(struct Avl_node *, struct Avl_node *))
+{
+	tree->at_root = NULL;
+	tree->at_first = NULL;
+	tree->at_cmp = cmp;
+}
+
+/* Overview:
+ *  Add `node` to `tree`, after the nodes that compare equal to it.
+ */
+void avl_insert(struct Avl_tree *tree, struct Avl_node *node)
+{
+	struct Avl_node *parent = NULL;
+	struct Avl_node **link = &tree->at_root;
+	int leftmost = 1;
+
+	while (*link != NULL) {
+		parent = *link;
+		if (tree->at_cmp(node, parent) < 0) {
+			link = &parent->an_left;
+		} else {
+			link = &parent->an_right;
+			leftmost = 0;
+		}
+	}
+
+	node->an_left = NULL;
+	node->an_right = NULL;
+	node->an_parent = parent;
+	node->an_height = 1;
+	*link = node;
+	if (leftmost) {
+		tree->at_first = node;
+	}
+	avl_rebalance(tree, parent);
+}
+
+/* Overview:
+ *  Take `node` out of `tree`.
+ */
+void avl_remove(struct Avl_tree *tree, struct Avl_node *node)
+{
+	struct Avl_node *child, *succ, *start;
+
+	if (tree->at_first == node) {
+		tree->at_first = avl_next(node);
+	}
+
+	if (node->an_left && node->an_right) {
+		/* Put the successor, which has no left child, in its place. */
+		for (succ = node->an_right; succ->an_left; succ = succ->an_left)
+			;
+		start = succ->an_parent == node ? succ : succ->an_parent;
+		if (succ->an_parent != node) {
+			succ->an_parent->an_left = succ->an_right;
+			if (succ->an_right) {
+				succ->an_right->an_parent = succ->an_parent;
+			}
+			succ->an_right = node->an_right;
+			node->an_right->an_parent = succ;
+		}
+		succ->an_left = node->an_left;
+		node->an_left->an_parent = succ;
+		succ->an_parent = node->an_parent;
+		avl_replace(tree, node->an_parent, node, succ);
+		succ->an_height = node->an_height;
+	} else {
+		child = node->an_left ? node->an_left : node->an_right;
+		if (child) {
+			child->an_parent = node->an_parent;
+		}
+		avl_replace(tree, node->an_parent, node, child);
+		start = node->an_parent;
+	}
+
+	node->an_height = 0;
+	avl_rebalance(tree, start);
+}
+
+/* Overview:
+ *  Return the node after `node` in order, or NULL.
+ */
+struct Avl_node *avl_next(struct Avl_node *node)
+{
+	struct Avl_node *n;
+
+	if (node->an_right) {
+		for (n = node->an_right; n->an_left; n = n->an_left)
+			;
+		return n;
+	}
+	while (node->an_parent && node->an_parent->an_right == node) {
+		node = node->an_parent;
+	}
+	return node->an_parent;
+}
@@ -0,0 +1,57 @@
+#include "../drivers/gxconsole/dev_cons.h"
+#include <env.h>
+#include <sched.h>
+#include <cons.h>
+
+#define CONS_GETCHAR	(0x80000000 + DEV_CONS_ADDRESS + DEV_CONS_PUTGETCHAR)
+
+static char cons_buf[CONS_BUFSIZE];
+static u_int cons_rpos, cons_wpos;	// free running, index modulo CONS_BUFSIZE
+
+struct Wait_queue cons_wait;		// envs blocked in sys_cgetc
+
+void cons_init(void)
+{
+	cons_rpos = cons_wpos = 0;
+	wq_init(&cons_wait);
+}
+
+/* Move whatever the console has into cons_buf. Characters that don't fit
+ * are dropped. */
+static void cons_poll(void)
+{
+	char c;
+
+	while ((c = *(volatile char *)CONS_GETCHAR) != 0) {
+		if (cons_wpos - cons_rpos < CONS_BUFSIZE) {
+			cons_buf[cons_wpos++ % CONS_BUFSIZE] = c;
+		}
+	}
+}
+
+/* Overview:
+ *  Console input interrupt: buffer the input and wake up the readers.
+ *  Envs run with it unmasked, as there may be no timer tick to poll on.
+ */
+void cons_intr(void)
+{
+	extern int cpu_idle_woken;
+
+	cpu_idle_woken = 1;
+	cons_poll();
+	if (cons_rpos != cons_wpos) {
+		wq_wake_all(&cons_wait);
+	}
+}
+
+/* Overview:
+ *  Return the next character typed, or 0 if there is none yet.
+ */
+int cons_getc(void)
+{
+	cons_poll();
+	if (cons_rpos == cons_wpos) {
+		return 0;
+	}
+	return cons_buf[cons_rpos++ % CONS_BUFSIZE];
+}
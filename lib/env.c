@@ -8,12 +8,20 @@
 #include <sched.h>
 #include <pmap.h>
 #include <printf.h>
+#include <rmap.h>
+#include <swap.h>
 
 struct Env* envs = NULL;	// All environments
 struct Env* curenv = NULL;  // the current env
 
 static struct Env_list env_free_list;  // Free list
-truct Env_list env_sched_list[2];	  // Runnable list
+int env_lazy_load = 1;				   // see env_load_page
+
+/* Charged for whatever happens while no env runs. */
+static struct Env_stats kernel_stats;
+struct Env_stats* curenv_stats = &kernel_stats;
+
+#define LOAD_ICODE_BATCH 16				   // zero pages per page_map_range
 
 extern Pde*  boot_pgdir;
 extern char* KERNEL_SP;
@@ -126,9 +134,10 @@ env_setup_vm(struct Env* e) {
 
 	/* Step 1: Allocate a page for the page directory using a function you completed in the lab2.
      * and add its reference.
-     * pgdir is the page directory of Env e, assign value for it. */
+     * pgdir is the page directory of Env e, assign value for it.
+     * The page right after it holds the (cleared) Pgdir_info. */
 
-	if ((r = page_alloc(&p)) < 0) { /* Todo here*/
+	if ((r = page_alloc_order(1, &p)) < 0) { /* Todo here*/
 		panic("env_setup_vm - page alloc error\n");
 		return r;
 	}
@@ -209,10 +218,17 @@ int env_alloc(struct Env** new, u_int parent_id) /* new: new environment */
 	e->env_id = mkenvid(e);
 	e->env_status = ENV_RUNNABLE;
 	e->env_parent_id = parent_id;
+	e->env_nseg = 0;
+	e->env_runs = 0;
+	e->env_ipc_recving = 0;
+	e->env_wq = NULL;
+	wq_init(&e->env_ipc_wait);
+	wq_init(&e->env_ipc_senders);
+	bzero(&e->env_stats, sizeof(e->env_stats));
 
 	/*Step 4: focus on initializing env_tf structure, located at this new Env.
      * especially the sp register,CPU status. */
-	e->env_tf.cp0_status = 0x10001004;
+	e->env_tf.cp0_status = 0x10001404;			// 时钟(IM4)与控制台(IM2)中断
 	e->env_tf.regs[29] = USTACKTOP;					// 29 号寄存器是栈寄存器
 
 	/*Step 5: Remove the new Env from Env free list*/
@@ -222,6 +238,84 @@ int env_alloc(struct Env** new, u_int parent_id) /* new: new environment */
 }
 
 
+/* Overview:
+ *   Whether the page at `pva` of segment `sg` can simply be the page of the
+ * image in kernel memory, rather than a copy of it: the segment must be
+ * read-only, page-congruent with the image, and the page mustn't need any
+ * zero fill or reach outside of the image. A page starting before the
+ * segment holds bytes of something else (the ELF header, say), which the
+ * program must not see.
+ */
+static int load_icode_shareable(struct Env* e, struct Env_seg* sg, u_long pva) {
+	u_char* kva = sg->sg_bin + (pva - sg->sg_va);
+
+	return !(sg->sg_flags & PF_W) && pva >= sg->sg_va &&
+		   (((u_long)sg->sg_bin - sg->sg_va) & (BY2PG - 1)) == 0 &&
+		   MIN(pva + BY2PG, sg->sg_va + sg->sg_memsz) <= sg->sg_va + sg->sg_filesz &&
+		   kva >= e->env_bin && kva + BY2PG <= e->env_bin + e->env_binsize;
+}
+
+/* Overview:
+ *   Load the part of segment `sg` that falls into the page at `pva`.
+ * Bytes of the image are copied into the page mapped there (a new one if
+ * there's none yet). A page with no byte of the image in it is all zero,
+ * so it just shares the zero page, and a read-only page may share the
+ * image itself (see load_icode_shareable). Both are mapped copy-on-write.
+ *
+ * Pre-Condition:
+ *   pva is 4KB aligned and the page overlaps the segment.
+ *
+ * Post-Condition:
+ *   return 0 on success, otherwise < 0.
+ */
+static int load_icode_page(struct Env* e, struct Env_seg* sg, u_long pva) {
+	struct Page* p;
+	struct Page* old;
+	u_long		 start, end;		// the image bytes in this page
+	int			 r;
+
+	start = sg->sg_va > pva ? sg->sg_va : pva;
+	end = MIN(pva + BY2PG, sg->sg_va + sg->sg_filesz);
+
+	/* Another segment may have filled this page before it was swapped out. */
+	if ((r = swap_in(e->env_pgdir, pva)) < 0 && r != -E_INVAL) {
+		return r;
+	}
+	p = page_lookup(e->env_pgdir, pva, NULL);
+	if (start >= end) {
+		if (p != NULL) {
+			return 0;
+		}
+		return page_insert(e->env_pgdir, zero_page, pva, PTE_COW | PTE_R);
+	}
+
+	if (p == NULL && load_icode_shareable(e, sg, pva)) {
+		p = pa2page(PADDR(sg->sg_bin + (pva - sg->sg_va)));
+		p->pp_flags |= PG_RESERVED;
+		return page_insert(e->env_pgdir, p, pva, PTE_COW | PTE_R);
+	}
+
+	/* Never write into a shared page, start from a private copy of it.
+	 * A page the image fills up needn't be cleared first. */
+	if (p == NULL || (p->pp_flags & PG_RESERVED)) {
+		old = (p != NULL && p != zero_page) ? p : NULL;
+		r = swap_page_alloc(&p, old || end - start == BY2PG ? PA_NOZERO : PA_ZERO);
+		if (r < 0) {
+			return r;
+		}
+		if (old) {
+			bcopy((void*)page2kva(old), (void*)page2kva(p), BY2PG);
+		}
+		if ((r = page_insert(e->env_pgdir, p, pva, PTE_R)) < 0) {
+			page_free(p);
+			return r;
+		}
+	}
+	bcopy(sg->sg_bin + (start - sg->sg_va), (void*)(page2kva(p) + start - pva),
+		  end - start);
+	return 0;
+}
+
 /* Overview:
  *   This is a call back function for kernel's elf loader.
  * Elf loader extracts each segment of the given binary image.
@@ -239,8 +333,8 @@ int env_alloc(struct Env** new, u_int parent_id) /* new: new environment */
  *   return 0 on success, otherwise < 0.
  */
 // map each segment at correct virtual address.
-static int load_icode_mapper(u_long va, u_int32_t sgsize,
-							 u_char* bin, u_int32_t bin_size, void* user_data) {
+static int load_icode_mapper(u_long va, u_int32_t sgsize, u_char* bin,
+							 u_int32_t bin_size, u_int32_t flags, void* user_data) {
 	/*
 	 |offset|
 	 |-----------|---BY2PG---|---......----|---BY2PG---|-----------|00000000000|000....000|00000000000|
@@ -248,95 +342,98 @@ static int load_icode_mapper(u_long va, u_int32_t sgsize,
 	      va                                          va+bin_size
 	 */
 
-	struct Env*  env = (struct Env*)user_data;
-	struct Page* p = NULL;
-	u_long		 i;
-	int			 r;
-	Pde* pgdir = env->env_pgdir;
-	u_long offset = va - ROUNDDOWN(va, BY2PG);				// 向下取整去除offset
-
-	if (offset > 0) {
-		page_alloc(&p);
-		page_insert(pgdir, p, ROUNDDOWN(va, BY2PG), PTE_R);		
-		bcopy(bin, page2kva(p) + offset, BY2PG - offset);
-		i = BY2PG - offset;
+	struct Env*	   env = (struct Env*)user_data;
+	struct Env_seg sg;
+	struct Page*   zeros[LOAD_ICODE_BATCH];
+	u_long		   pva, end;
+	u_int		   n;
+	int			   r;
+
+	sg.sg_va = va;
+	sg.sg_memsz = sgsize;
+	sg.sg_bin = bin;
+	sg.sg_filesz = bin_size;
+	sg.sg_flags = flags;
+
+	/* An empty segment maps nothing, not even its first page. */
+	if (sgsize == 0) {
+		return 0;
 	}
 
-	/*Step 1: load all content of bin into memory. */
-	u_long tempVa = ROUND(va,BY2PG);						// 向上取整
-	for (; i+BY2PG <= bin_size; i += BY2PG) {
-		/* Hint: You should alloc a page and increase the reference count of it. */
-		page_alloc(&p);
-		page_insert(pgdir,p,tempVa,PTE_R);
-		bcopy(bin+i,page2kva(p),BY2PG);
-		tempVa+=BY2PG;
-	}
-	if (bin_size>i) {
-		page_alloc(&p);
-		page_insert(pgdir,p,tempVa,PTE_R);
-		bcopy(bin+i,page2kva(p),bin_size-i);
-		i = i+BY2PG;
-		tempVa+=BY2PG;
-	}
-	/*Step 2: alloc pages to reach `sgsize` when `bin_size` < `sgsize`.
-	 * i has the value of `bin_size` now. */
-	while (i+BY2PG<sgsize) {
-		page_alloc(&p);
-		page_insert(pgdir,p,tempVa,PTE_R);
-		bzero(page2kva(p),BY2PG);//fill into zeros
-		i = i+BY2PG;
-		tempVa+=BY2PG;
-	}
-	if (sgsize>i) {
-		page_alloc(&p);
-		page_insert(pgdir,p,tempVa,PTE_R);
-		bzero(page2kva(p),sgsize-i);
+	/* Step 1: the first page (it may be shared with the previous segment)
+	 * and the pages holding `bin`. */
+	pva = ROUNDDOWN(va, BY2PG);
+	end = ROUND(va + sgsize, BY2PG);
+	while (pva < end && (pva < va || pva < ROUND(va + bin_size, BY2PG))) {
+		if ((r = load_icode_page(env, &sg, pva)) < 0) {
+			return r;
+		}
+		pva += BY2PG;
 	}
-	return 0;
 
-	// ----------------------------------------------------------------------
-	// 应该也是对的
-	// Step 1: load all content of bin into memory. 
-	for ( ; i < bin_size; i += BY2PG) {
-		// Hint: You should alloc a page and increase the reference count of it. 
-		if (page_alloc(&p) < 0) {
-			printf("Sorry,alloc page failed!\n");
+	/* Step 2: Pages past `bin_size` hold nothing but zeros and share the
+	 * zero page, a private page is only allocated once the program writes
+	 * to it. Map them a batch at a time. */
+	for (n = 0; n < LOAD_ICODE_BATCH; n++) {
+		zeros[n] = zero_page;
+	}
+	for (; pva < end; pva += n * BY2PG) {
+		n = MIN((end - pva) / BY2PG, LOAD_ICODE_BATCH);
+		if (page_map_range(env->env_pgdir, pva, zeros, n, PTE_COW | PTE_R) < n) {
 			return -E_NO_MEM;
 		}
-		p->pp_ref++;
-		page_insert(pgdir, p, ROUND(va, BY2PG) + i, PTE_R);
-        bcopy(bin + i, page2kva(p), BY2PG);
 	}
+	return 0;
+}
 
+/* Overview:
+ *   The call back function for the elf loader when `env_lazy_load` is set:
+ * just remember the segment, env_load_page loads it one page at a time as
+ * the program touches it. If there's no room left, load it right now.
+ */
+static int load_icode_record(u_long va, u_int32_t sgsize, u_char* bin,
+							 u_int32_t bin_size, u_int32_t flags, void* user_data) {
+	struct Env*		env = (struct Env*)user_data;
+	struct Env_seg* sg;
 
-	if(bin_size > i){			// ????? bin_size must be greater than i
-		page_alloc(&p);
-		page_insert(pgdir,p,ROUND(va, BY2PG) + i, PTE_R);
-		bcopy(bin + i, page2kva(p), bin_size - i);
-		i += BY2PG;
+	if (env->env_nseg == ENV_NSEG) {
+		return load_icode_mapper(va, sgsize, bin, bin_size, flags, user_data);
 	}
+	sg = &env->env_seg[env->env_nseg++];
+	sg->sg_va = va;
+	sg->sg_memsz = sgsize;
+	sg->sg_bin = bin;
+	sg->sg_filesz = bin_size;
+	sg->sg_flags = flags;
+	return 0;
+}
 
-	//Step 2: alloc pages to reach `sgsize` when `bin_size` < `sgsize`.
-    //i has the value of `bin_size` now. 
-	while (i < sgsize) {
-		if(page_alloc(&p) < 0){
-			return -E_NO_MEM;
+/* Overview:
+ *   Called by pageout on a TLB miss at `va` in `e`: if `va` lies in a
+ * segment of its program image, load that page.
+ *
+ * Post-Condition:
+ *   return 1 if the page was loaded, 0 if `va` isn't part of the image,
+ *   otherwise < 0.
+ */
+int env_load_page(struct Env* e, u_long va) {
+	struct Env_seg* sg;
+	int				found = 0;
+	int				r;
+
+	va = ROUNDDOWN(va, BY2PG);
+	/* Segments may share a page, every one of them goes into it. */
+	for (sg = e->env_seg; sg < e->env_seg + e->env_nseg; sg++) {
+		if (va + BY2PG <= sg->sg_va || va >= sg->sg_va + sg->sg_memsz) {
+			continue;
 		}
-		p->pp_ref++;
-		if(page_insert(pgdir, p, ROUND(va, BY2PG) + i, PTE_R) < 0){
-			return -E_NO_MEM;
+		if ((r = load_icode_page(e, sg, va)) < 0) {
+			return r;
 		}
-		bzero(page2kva(p),BY2PG);
-		i += BY2PG;
+		found = 1;
 	}
-
-	if(sgsize>i){
-		page_alloc(&p);
-		page_insert(pgdir,p,ROUND(va, BY2PG) + i,PTE_R);
-		bzero(page2kva(p),sgsize-i);
-	}
-
-	return 0;
+	e->env_stats.es_pagein += found;
+	return found;
 }
 
 /* // 解析ELF 文件的函数
@@ -398,7 +495,10 @@ load_icode(struct Env* e, u_char* binary, u_int size) {
 	// 使用load_elf函数将每个segment都加载到正确的地方，并将PC寄存器移动到代码入口地址，即为entry_point，虚地址入口
 	// 代码段预先被载入到了entry_ point为起点的内存中
 
-	load_elf(binary, size, &entry_point, (void*)e, load_icode_mapper);
+	e->env_bin = binary;
+	e->env_binsize = size;
+	load_elf(binary, size, &entry_point, (void*)e,
+			 env_lazy_load ? load_icode_record : load_icode_mapper);
 
 	/***Your Question Here***/
 	/*Step 4:Set CPU's PC register as appropriate value. */
@@ -432,6 +532,7 @@ void env_create_priority(u_char* binary, int size, int priority) {
 	/*Step 3: Use load_icode() to load the named elf binary. */
 
 	load_icode(e, binary, size);
+	sched_insert(e);
 
 }
 /* Overview:
@@ -452,30 +553,40 @@ void env_create(u_char* binary, int size) {
  *  Frees env e and all memory it uses.
  */
 void env_free(struct Env* e) {
-	Pte*  pt;
-	u_int pdeno, pteno, pa;
+	struct Pgdir_info* info;
+	Pte*			   pt;
+	Pde				   pde;
+	u_int			   pdeno, pteno, pa;
 
 	/* Hint: Note the environment's demise.*/
 	printf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	/* Hint: Flush all mapped pages in the user portion of the address space */
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-		/* Hint: only look at mapped page tables. */
-		if (!(e->env_pgdir[pdeno] & PTE_V)) {
-			continue;
-		}
-		/* Hint: find the pa and va of the page table. */
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
+	/* Hint: Flush all mapped pages in the user portion of the address space.
+	 * Only the tables the env has are visited, each only up to its last
+	 * valid PTE. The TLB is left alone: the env's ASID won't be handed
+	 * out again before the next generation flushes the whole TLB. */
+	info = pgdir_info(e->env_pgdir);
+	for (pdeno = pgdir_next_table(e->env_pgdir, 0); pdeno < PDX(UTOP);
+		 pdeno = pgdir_next_table(e->env_pgdir, pdeno + 1)) {
+		pde = e->env_pgdir[pdeno];
+		pa = PTE_ADDR(pde);
 		pt = (Pte*)KADDR(pa);
-		/* Hint: Unmap all PTEs in this page table. */
-		for (pteno = 0; pteno <= PTX(~0); pteno++)
+		for (pteno = 0; info->pi_count[pdeno] > 0 && pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_V) {
-				page_remove(e->env_pgdir, (pdeno << PDSHIFT) | (pteno << PGSHIFT));
+				rmap_del(pa2page(pt[pteno]), e->env_pgdir,
+						 (pdeno << PDSHIFT) | (pteno << PGSHIFT));
+				page_decref(pa2page(pt[pteno]));
+				info->pi_count[pdeno]--;
+			} else if (pt[pteno] & PTE_SWAP) {
+				swap_drop(pt[pteno]);
+				info->pi_count[pdeno]--;
 			}
+		}
 		/* Hint: free the page table itself. */
 		e->env_pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 	}
+
 	/* Hint: free the page directory. */
 	pa = e->env_cr3;
 	e->env_pgdir = 0;
@@ -483,8 +594,11 @@ void env_free(struct Env* e) {
 	page_decref(pa2page(pa));
 	/* Hint: return the environment to the free list. */
 	e->env_status = ENV_FREE;
+	sched_remove(e);
+	wq_remove(e);
+	/* Hint: whoever waited to send to it gets an error now. */
+	wq_wake_all(&e->env_ipc_senders);
 	LIST_INSERT_HEAD(&env_free_list, e, env_link);
-	LIST_REMOVE(e, env_sched_link);
 }
 
 /* Overview:
@@ -498,6 +612,7 @@ void env_destroy(struct Env* e) {
 	/* Hint: schedule to run a new environment. */
 	if (curenv == e) {
 		curenv = NULL;
+		curenv_stats = &kernel_stats;
 		/* Hint:Why this? */
 		bcopy((void*)KERNEL_SP - sizeof(struct Trapframe),
 			  (void*)TIMESTACK - sizeof(struct Trapframe),
@@ -507,6 +622,19 @@ void env_destroy(struct Env* e) {
 	}
 }
 
+/* Overview:
+ *  Take curenv off the CPU without freeing it: its registers are saved
+ *  from `tf`, and it stays ENV_NOT_RUNNABLE until someone queues it again.
+ *  Used by wq_wait, on the frame of the syscall that blocks.
+ */
+void env_suspend(struct Trapframe* tf) {
+	curenv->env_tf = *tf;
+	curenv->env_tf.pc = tf->cp0_epc;
+	curenv->env_status = ENV_NOT_RUNNABLE;
+	curenv = NULL;
+	curenv_stats = &kernel_stats;
+}
+
 extern void env_pop_tf(struct Trapframe* tf, int id);
 extern void lcontext(u_int contxt);
 
@@ -530,7 +658,8 @@ void env_run(struct Env* e) {
 
     struct Trapframe *old = (struct Trapframe *)(TIMESTACK - sizeof(struct Trapframe));
     // 中断之后应该跳转的地址
-    if(curenv != NULL && curenv != e){
+    // curenv 继续运行时也要保存：它的 env_tf 早已过时。
+    if(curenv != NULL){
     	curenv->env_tf = *old;
     	curenv->env_tf.pc = curenv->env_tf.cp0_epc; 
     }
@@ -539,19 +668,24 @@ void env_run(struct Env* e) {
 
     curenv = e;
     curenv->env_status = ENV_RUNNABLE;
+    curenv->env_runs++;
+    curenv_stats = &e->env_stats;
 
-	/*Step 3: Use lcontext() to switch to its address space. */
+	/*Step 3: Use lcontext() to switch to its address space.
+	 * TLB entries dropped while it wasn't running are only queued. */
 
+    tlb_flush_pending(e->env_pgdir);
     lcontext(e->env_pgdir);
 
 	/*Step 4: Use env_pop_tf() to restore the environment's
      * environment   registers and drop into user mode in the
      * the   environment.
      */
-	/* Hint: You should use GET_ENV_ASID there.Think why? */
+	/* Hint: The ASID comes from pgdir_asid, which gives the address space
+	 * a fresh one if its own is from an older generation. */
 	// extern void env_pop_tf(struct Trapframe* tf, int id);
 
-	env_pop_tf(&(e->env_tf), GET_ENV_ASID(e->env_id));
+	env_pop_tf(&(e->env_tf), pgdir_asid(e->env_pgdir));
 }
 
 void env_check() {
@@ -616,7 +750,7 @@ void env_check() {
 	assert(pe2->env_pgdir[PDX(UTOP) - 1] == 0);
 	printf("env_setup_vm passed!\n");
 
-	assert(pe2->env_tf.cp0_status == 0x10001004);
+	assert(pe2->env_tf.cp0_status == 0x10001404);
 	printf("pe2`s sp register %x\n", pe2->env_tf.regs[29]);
 	printf("env_check() succeeded!\n");
 }
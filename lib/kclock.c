@@ -3,6 +3,7 @@
 /* The Run Time Clock and other NVRAM access functions that go with it. */
 /* The run time clock is hard-wired to IRQ8. */
 
+#include <types.h>
 #include <kclock.h>
 
 
@@ -21,3 +22,38 @@ kclock_init(void)
 	//printf("	unmasked timer interrupt\n");
 	
 }
+
+/* Overview:
+ *  Read the RTC as a microsecond counter. It wraps after about 71 minutes,
+ *  so it is only good for measuring short intervals by subtraction.
+ */
+u_int
+kclock_usec(void)
+{
+	u_int sec, usec;
+
+	*(volatile u_char *)IO_RTC_TRIGGER = 0;
+	sec = *(volatile u_int *)IO_RTC_SEC;
+	usec = *(volatile u_int *)IO_RTC_USEC;
+	return sec * 1000000 + usec;
+}
+
+/* Overview:
+ *  Reprogram the RTC to interrupt `hz` times a second, or never if `hz`
+ *  is 0.
+ */
+void
+kclock_set_hz(u_int hz)
+{
+	*(volatile u_char *)IO_RTC = hz;
+}
+
+/* Overview:
+ *  Acknowledge the RTC interrupt, so it is only raised again on the next
+ *  tick.
+ */
+void
+kclock_ack(void)
+{
+	*(volatile u_int *)IO_RTC_ACK = 0;
+}
@@ -42,10 +42,12 @@ int is_elf_format(u_char *binary)           // question!!
  * Post-Condition:
  *   Return 0 if success. Otherwise return < 0.
  *   If success, the entry point of `binary` will be stored in `start`
+ *   `map` gets the PF_* flags of each segment too.
  */
 int load_elf(u_char *binary, int size, u_long *entry_point, void *user_data,
 			 int (*map)(u_long va, u_int32_t sgsize,
-						u_char *bin, u_int32_t bin_size, void *user_data))
+						u_char *bin, u_int32_t bin_size, u_int32_t flags,
+						void *user_data))
 {
 	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)binary;
 	Elf32_Phdr *phdr = NULL;
@@ -76,7 +78,7 @@ int load_elf(u_char *binary, int size, u_long *entry_point, void *user_data,
 
         if(phdr->p_type == PT_LOAD) {
             r = map(phdr->p_vaddr, phdr->p_memsz, binary + phdr->p_offset,
-                phdr->p_filesz, user_data);
+                phdr->p_filesz, phdr->p_flags, user_data);
             if(r < 0){
                return r;
             }
@@ -1,17 +1,500 @@
 #include <env.h>
 #include <pmap.h>
 #include <printf.h>
+#include <sched.h>
+#include <bitops.h>
+#include <avl.h>
+#include <kclock.h>
+
+/* Pages cleared by page_zero_idle each time the scheduler finds itself idle. */
+#define SCHED_ZERO_BUDGET	8
+
+int sched_policy = SCHED_RR;		// fixed by sched_init, see sched.h
+
+/* A scheduling class: how runnable envs (other than curenv) are kept, and
+ * when curenv has to give the CPU away. */
+struct Sched_class {
+	void (*sc_insert)(struct Env *e);	// a new or woken env
+	void (*sc_requeue)(struct Env *e);	// curenv, preempted
+	int (*sc_remove)(struct Env *e);	// 1 if it was queued
+	struct Env *(*sc_pick)(void);		// remove and return the next env
+	void (*sc_tick)(struct Env *curr, u_int usec);	// charge curr
+	int (*sc_need_resched)(struct Env *curr);
+};
+
+static struct Sched_class *sched_class;
+static u_int sched_nr_queued;		// envs waiting on the run queue
+
+/* Tickless: with nobody waiting for the CPU the RTC is stopped, as there
+ * is nothing to preempt curenv for. Run time is charged in microseconds
+ * read from the RTC, not by counting ticks, so time between ticks (before
+ * blocking, or before a wakeup restarts the tick) is charged too. */
+static u_int sched_hz = KCLOCK_HZ;	// what the RTC runs at now
+static u_int sched_last;		// kclock_usec() curenv was charged up to
+
+extern char *KERNEL_SP;
+extern void cpu_idle(int wait);
+
+static u_int sched_level(struct Env *e)
+{
+	return e->env_pri < SCHED_NPRI ? e->env_pri : SCHED_NPRI - 1;
+}
+
+
+/*
+ * SCHED_RR: an env runs for env_pri ticks at a time, highest level first.
+ * Runnable envs sit in one of two arrays of per-priority queues. New envs
+ * go to the active one, and an env whose slice ran out goes to the
+ * expired one. Once the active array drains the two swap places, so no
+ * env waits more than one round, however high the priority of the others.
+ * Bit n of an array's bitmap is set iff its level n queue has an env, so
+ * every operation is O(1).
+ */
+struct Rr_array {
+	struct Env_tailq ra_queue[SCHED_NPRI];
+	u_int ra_bitmap;
+};
+
+static struct Rr_array rr_arrays[2];
+static struct Rr_array *rr_active = &rr_arrays[0];
+static struct Rr_array *rr_expired = &rr_arrays[1];
+
+static void rr_enqueue(struct Rr_array *ra, struct Env *e)
+{
+	u_int pri = sched_level(e);
+
+	TAILQ_INSERT_TAIL(&ra->ra_queue[pri], e, env_sched_link);
+	ra->ra_bitmap |= 1 << pri;
+	e->env_rq = &ra->ra_queue[pri];
+}
+
+static void rr_insert(struct Env *e)
+{
+	rr_enqueue(rr_active, e);
+}
+
+static void rr_requeue(struct Env *e)
+{
+	rr_enqueue(rr_expired, e);
+}
+
+static int rr_remove(struct Env *e)
+{
+	struct Rr_array *ra;
+	u_int pri = sched_level(e);
+
+	if (e->env_rq == NULL) {
+		return 0;
+	}
+	ra = e->env_rq == &rr_arrays[0].ra_queue[pri] ? &rr_arrays[0] : &rr_arrays[1];
+	TAILQ_REMOVE(e->env_rq, e, env_sched_link);
+	if (TAILQ_EMPTY(e->env_rq)) {
+		ra->ra_bitmap &= ~(1 << pri);
+	}
+	e->env_rq = NULL;
+	return 1;
+}
+
+static struct Env *rr_pick(void)
+{
+	struct Rr_array *ra;
+	struct Env *e;
+
+	/* Everybody had their turn: start the next round. */
+	if (rr_active->ra_bitmap == 0) {
+		ra = rr_active;
+		rr_active = rr_expired;
+		rr_expired = ra;
+	}
+	if (rr_active->ra_bitmap == 0) {
+		return NULL;
+	}
+
+	e = TAILQ_FIRST(&rr_active->ra_queue[fls32(rr_active->ra_bitmap)]);
+	rr_remove(e);
+	e->env_slice = (e->env_pri ? e->env_pri : 1) * KCLOCK_TICK_USEC;
+	return e;
+}
+
+static void rr_tick(struct Env *curr, u_int usec)
+{
+	curr->env_slice = curr->env_slice > usec ? curr->env_slice - usec : 0;
+}
+
+/* Less than half a tick left: the next tick would overrun the slice. */
+static int rr_need_resched(struct Env *curr)
+{
+	return curr->env_slice < KCLOCK_TICK_USEC / 2;
+}
+
+static struct Sched_class rr_class = {
+	rr_insert, rr_requeue, rr_remove, rr_pick, rr_tick, rr_need_resched,
+};
+
+
+/*
+ * SCHED_FAIR: each env is charged virtual run time inversely to its weight,
+ * and the one with the least runs next. Runnable envs are kept in an AVL
+ * tree keyed by env_vruntime, whose leftmost node is cached.
+ *
+ * env_pri maps to the CFS weight of nice (1 - env_pri): the default
+ * priority 1 weighs 1024, and each level up weighs about 1.25 times more.
+ * The table holds 2^24 / weight, the charge for 2^20 us (about a second),
+ * so charging never needs a division. Comparisons use differences, so
+ * env_vruntime may wrap.
+ */
+static const u_int fair_charge[SCHED_NPRI] = {
+	20460, 16384, 13137, 10578, 8426, 6708, 5375, 4295,
+	3421, 2750, 2201, 1757, 1407, 1122, 896, 721,
+	575, 462, 362, 297, 233, 189, 189, 189,
+	189, 189, 189, 189, 189, 189, 189, 189,
+};
+
+/* How far curenv may get ahead of the leftmost env before it is preempted:
+ * about a second (one KCLOCK_HZ tick) of a default priority env. */
+#define FAIR_GRANULARITY	16384
+
+static struct Avl_tree fair_tree;
+static u_int fair_min_vruntime;		// never goes back
+
+#define FAIR_BEFORE(a, b)	((int)((a) - (b)) < 0)
+
+static int fair_cmp(struct Avl_node *a, struct Avl_node *b)
+{
+	u_int va = AVL_ENTRY(a, struct Env, env_fair_node)->env_vruntime;
+	u_int vb = AVL_ENTRY(b, struct Env, env_fair_node)->env_vruntime;
+
+	return FAIR_BEFORE(va, vb) ? -1 : va != vb;
+}
+
+static struct Env *fair_first(void)
+{
+	struct Avl_node *n = avl_first(&fair_tree);
+
+	return n ? AVL_ENTRY(n, struct Env, env_fair_node) : NULL;
+}
+
+/* Move fair_min_vruntime up to the least vruntime of `curr` and the tree. */
+static void fair_update_min(struct Env *curr)
+{
+	struct Env *first = fair_first();
+	u_int v;
+
+	if (curr == NULL && first == NULL) {
+		return;
+	}
+	if (curr == NULL || (first && FAIR_BEFORE(first->env_vruntime, curr->env_vruntime))) {
+		v = first->env_vruntime;
+	} else {
+		v = curr->env_vruntime;
+	}
+	if (FAIR_BEFORE(fair_min_vruntime, v)) {
+		fair_min_vruntime = v;
+	}
+}
+
+static void fair_insert(struct Env *e)
+{
+	/* A new env, or one that was away, starts level with the others
+	 * instead of owning the CPU until it has caught up. */
+	if (e->env_runs == 0 || FAIR_BEFORE(e->env_vruntime, fair_min_vruntime)) {
+		e->env_vruntime = fair_min_vruntime;
+	}
+	avl_insert(&fair_tree, &e->env_fair_node);
+}
+
+static int fair_remove(struct Env *e)
+{
+	if (!avl_linked(&e->env_fair_node)) {
+		return 0;
+	}
+	avl_remove(&fair_tree, &e->env_fair_node);
+	return 1;
+}
+
+static struct Env *fair_pick(void)
+{
+	struct Env *e = fair_first();
+
+	if (e != NULL) {
+		avl_remove(&fair_tree, &e->env_fair_node);
+		fair_update_min(e);
+	}
+	return e;
+}
+
+static void fair_tick(struct Env *curr, u_int usec)
+{
+	curr->env_vruntime +=
+		((unsigned long long)usec * fair_charge[sched_level(curr)]) >> 20;
+	fair_update_min(curr);
+}
+
+static int fair_need_resched(struct Env *curr)
+{
+	struct Env *first = fair_first();
+
+	return first != NULL &&
+		   (int)(curr->env_vruntime - first->env_vruntime) > FAIR_GRANULARITY;
+}
+
+static struct Sched_class fair_class = {
+	fair_insert, fair_insert, fair_remove, fair_pick, fair_tick, fair_need_resched,
+};
+
+
+/* Overview:
+ *  Set up the class `sched_policy` names. Envs are only queued afterwards.
+ */
+void sched_init(void)
+{
+	int i;
+
+	for (i = 0; i < SCHED_NPRI; i++) {
+		TAILQ_INIT(&rr_arrays[0].ra_queue[i]);
+		TAILQ_INIT(&rr_arrays[1].ra_queue[i]);
+	}
+	rr_arrays[0].ra_bitmap = 0;
+	rr_arrays[1].ra_bitmap = 0;
+	avl_init(&fair_tree, fair_cmp);
+	fair_min_vruntime = 0;
+	sched_nr_queued = 0;
+
+	sched_class = sched_policy == SCHED_RR ? &rr_class : &fair_class;
+}
+
+/* Charge curenv for the time it ran since sched_last. */
+static void sched_account(void)
+{
+	u_int now = kclock_usec();
+
+	if (curenv != NULL && curenv->env_status == ENV_RUNNABLE) {
+		sched_class->sc_tick(curenv, now - sched_last);
+	}
+	sched_last = now;
+}
+
+static void sched_set_hz(u_int hz)
+{
+	if (hz != sched_hz) {
+		kclock_set_hz(hz);
+		sched_hz = hz;
+	}
+}
+
+/* Program the RTC before running an env: no tick if nobody waits for
+ * the CPU, the regular one otherwise. */
+static void sched_program(void)
+{
+	sched_set_hz(sched_nr_queued ? KCLOCK_HZ : 0);
+}
 
 /* Overview:
- *  Implement simple round-robin scheduling.
- *  Search through 'envs' for a runnable environment ,
- *  in circular fashion statrting after the previously running env,
- *  and switch to the first such environment found.
+ *  Make the runnable env `e` wait for the CPU. If curenv was running
+ *  alone without a tick, it is charged so far and gets one again.
+ */
+void sched_insert(struct Env *e)
+{
+	sched_class->sc_insert(e);
+	sched_nr_queued++;
+
+	if (sched_hz == 0 && curenv != NULL && curenv->env_status == ENV_RUNNABLE) {
+		sched_account();
+		sched_program();
+	}
+}
+
+/* Overview:
+ *  Take `e` off the run queue, if it is on it.
+ */
+void sched_remove(struct Env *e)
+{
+	if (sched_class->sc_remove(e)) {
+		sched_nr_queued--;
+	}
+}
+
+/* Overview:
+ *  Acknowledge the timer interrupt and charge curenv for the time it ran.
+ *  Called from timer_irq, right before sched_yield.
+ */
+void sched_tick(void)
+{
+	kclock_ack();
+	sched_account();
+}
+
+/* Overview:
+ *  Let curenv go on, or switch to the env the scheduling class picks.
  *
  * Hints:
- *  The variable which is for counting should be defined as 'static'.
+ *  This never returns: it ends in env_run.
  */
 void sched_yield(void)
 {
+	struct Env *e = curenv;
+
+	/* Step 1: Keep curenv while its class lets it, charged up to now. */
+	sched_account();
+	if (e != NULL && e->env_status == ENV_RUNNABLE) {
+		if (!sched_class->sc_need_resched(e)) {
+			sched_program();
+			env_run(e);
+		}
+		sched_class->sc_requeue(e);
+		sched_nr_queued++;
+	}
+
+	/* Step 2: Nothing runnable: stop the tick, spend the time clearing
+	 * free pages ahead, and let interrupts in until one of them wakes an
+	 * env up. Once the zeroed pool is full, wait for an interrupt. */
+	while ((e = sched_class->sc_pick()) == NULL) {
+		sched_set_hz(0);
+		cpu_idle(page_zero_idle(SCHED_ZERO_BUDGET) < SCHED_ZERO_BUDGET);
+	}
+	sched_nr_queued--;
+
+	/* Step 3: Run the chosen one, charged from now on: the time spent
+	 * idle above is nobody's. */
+	sched_last = kclock_usec();
+	sched_program();
+	env_run(e);
+}
+
+
+/*
+ * Wait queues. A blocked env is ENV_NOT_RUNNABLE and on no run queue, so it
+ * costs the scheduler nothing; it sits on the wait queue by env_sched_link
+ * until a wq_wake_* puts it back.
+ */
+void wq_init(struct Wait_queue *q)
+{
+	TAILQ_INIT(&q->wq_envs);
+}
+
+/* Put the blocked env `e` last on `q`. */
+static void wq_add(struct Wait_queue *q, struct Env *e)
+{
+	TAILQ_INSERT_TAIL(&q->wq_envs, e, env_sched_link);
+	e->env_wq = q;
+}
+
+/* Overview:
+ *  Block curenv on `q`, from inside a syscall, and run something else.
+ *  Once woken, curenv returns from the syscall with the v0 in its env_tf,
+ *  which the waker may set. A syscall that should rather be run again
+ *  moves the epc of its trapframe back onto the syscall instruction first.
+ *
+ * Hints:
+ *  This never returns.
+ */
+void wq_wait(struct Wait_queue *q)
+{
+	struct Env *e = curenv;
+
+	/* What it ran up to here counts, before it leaves the CPU. */
+	sched_account();
+	env_suspend((struct Trapframe *)(KERNEL_SP - sizeof(struct Trapframe)));
+	wq_add(q, e);
+	sched_yield();
+}
+
+/* Overview:
+ *  Take the blocked env `e` off its wait queue, if it is on one.
+ */
+void wq_remove(struct Env *e)
+{
+	if (e->env_wq != NULL) {
+		TAILQ_REMOVE(&e->env_wq->wq_envs, e, env_sched_link);
+		e->env_wq = NULL;
+	}
+}
+
+/* Overview:
+ *  Make the env that has waited longest on `q` runnable again.
+ */
+void wq_wake_one(struct Wait_queue *q)
+{
+	struct Env *e = TAILQ_FIRST(&q->wq_envs);
+
+	if (e == NULL) {
+		return;
+	}
+	wq_remove(e);
+	e->env_status = ENV_RUNNABLE;
+	sched_insert(e);
+}
+
+void wq_wake_all(struct Wait_queue *q)
+{
+	while (!TAILQ_EMPTY(&q->wq_envs)) {
+		wq_wake_one(q);
+	}
+}
+
+void sched_check(void)
+{
+	struct Env *e[3];
+	struct Wait_queue q;
+	u_int base, d0, d1, nr;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		assert(env_alloc(&e[i], 0) == 0);
+		e[i]->env_runs = 1;		// keep the vruntime set below
+	}
+
+	/* SCHED_FAIR picks the least vruntime first, whatever the insert order. */
+	assert(fair_first() == NULL);
+	base = fair_min_vruntime;
+	e[0]->env_vruntime = base + 300;
+	e[1]->env_vruntime = base + 100;
+	e[2]->env_vruntime = base + 200;
+	for (i = 0; i < 3; i++) {
+		fair_class.sc_insert(e[i]);
+	}
+	assert(fair_class.sc_pick() == e[1]);
+	assert(fair_class.sc_pick() == e[2]);
+	assert(fair_class.sc_pick() == e[0]);
+	assert(fair_class.sc_pick() == NULL);
+
+	/* The same run time costs a heavier env less vruntime, so it goes first
+	 * after both ran equally long, and the lighter one is preempted. */
+	base = fair_min_vruntime;
+	e[0]->env_pri = 1;
+	e[1]->env_pri = 8;
+	e[0]->env_vruntime = e[1]->env_vruntime = base;
+	fair_class.sc_tick(e[1], 2000000);
+	fair_class.sc_insert(e[1]);
+	fair_class.sc_tick(e[0], 2000000);
+	d0 = e[0]->env_vruntime - base;
+	d1 = e[1]->env_vruntime - base;
+	assert(d1 > 0 && d0 > 4 * d1);
+	assert(fair_class.sc_need_resched(e[0]));
+	fair_class.sc_insert(e[0]);
+	assert(fair_class.sc_pick() == e[1]);
+	assert(fair_class.sc_pick() == e[0]);
+
+	/* A wait queue wakes its envs in the order they blocked. */
+	nr = sched_nr_queued;
+	wq_init(&q);
+	for (i = 0; i < 3; i++) {
+		e[i]->env_status = ENV_NOT_RUNNABLE;
+		wq_add(&q, e[i]);
+	}
+	wq_remove(e[1]);
+	assert(e[1]->env_wq == NULL);
+	wq_wake_one(&q);
+	assert(e[0]->env_status == ENV_RUNNABLE && e[0]->env_wq == NULL);
+	assert(e[2]->env_status == ENV_NOT_RUNNABLE && e[2]->env_wq == &q);
+	assert(sched_nr_queued == nr + 1);
+	wq_wake_all(&q);
+	assert(e[2]->env_status == ENV_RUNNABLE && TAILQ_EMPTY(&q.wq_envs));
+	assert(sched_nr_queued == nr + 2);
 
+	for (i = 0; i < 3; i++) {
+		env_free(e[i]);
+	}
+	assert(sched_nr_queued == nr);
+	printf("sched_check() succeeded!\n");
 }
@@ -4,6 +4,8 @@
 #include <printf.h>
 #include <pmap.h>
 #include <sched.h>
+#include <cons.h>
+#include <swap.h>
 
 extern char *KERNEL_SP;
 extern struct Env *curenv;
@@ -71,6 +73,136 @@ int sys_env_alloc(void)
     return 0;
 }
 
+/* Overview:
+ *  Fork curenv in the kernel. The child starts with the parent's
+ *  registers, returning 0 from this syscall, and shares all of its user
+ *  pages copy-on-write (see page_fork): only the pages either of them
+ *  writes to later get copied, by page_fault_handler.
+ *
+ * Post-Condition:
+ *  Return the child's envid to the parent, or < 0 on error.
+ */
+int sys_env_fork(int sysno)
+{
+	struct Env *e;
+	struct Trapframe *tf;
+	int r;
+
+	if ((r = env_alloc(&e, curenv->env_id)) < 0) {
+		return r;
+	}
+
+	/* handle_sys already moved the epc past the syscall. */
+	tf = (struct Trapframe *)(KERNEL_SP - sizeof(struct Trapframe));
+	bcopy(tf, &e->env_tf, sizeof(struct Trapframe));
+	e->env_tf.pc = tf->cp0_epc;
+	e->env_tf.regs[2] = 0;
+
+	e->env_pri = curenv->env_pri;
+	e->env_pgfault_handler = curenv->env_pgfault_handler;
+	e->env_xstacktop = curenv->env_xstacktop;
+
+	/* Image pages the parent never touched are still loaded on demand. */
+	e->env_bin = curenv->env_bin;
+	e->env_binsize = curenv->env_binsize;
+	bcopy(curenv->env_seg, e->env_seg, sizeof(e->env_seg));
+	e->env_nseg = curenv->env_nseg;
+
+	if ((r = page_fork(curenv->env_pgdir, e->env_pgdir)) < 0) {
+		env_free(e);
+		return r;
+	}
+	sched_insert(e);
+	return e->env_id;
+}
+
+
+/* Overview:
+ *  Copy `len` bytes from `src` to `dstva` in the address space of curenv,
+ *  through the kernel address of each page it maps there. A page it hasn't
+ *  touched yet is brought in as pageout would for a write: read back from
+ *  swap, loaded from the program image, or else a fresh zero page. A
+ *  copy-on-write page gets its private copy first.
+ *
+ * Post-Condition:
+ *  Return 0 on success, -E_INVAL if the range isn't all in user memory
+ *  (at or above pageout's 0x10000, below UTOP) and writable, or < 0 if a
+ *  page can't be brought in.
+ */
+static int copyout(u_long dstva, const void *src, u_int len)
+{
+	struct Page *p;
+	Pte *pte;
+	u_long va;
+	u_int n;
+	int r;
+
+	if (dstva + len < dstva || dstva + len > UTOP) {
+		return -E_INVAL;
+	}
+
+	while (len > 0) {
+		va = ROUNDDOWN(dstva, BY2PG);
+		n = MIN(len, va + BY2PG - dstva);
+
+		if ((r = swap_in(curenv->env_pgdir, va)) < 0 && r != -E_INVAL) {
+			return r;
+		}
+		if ((p = page_lookup(curenv->env_pgdir, va, &pte)) == NULL) {
+			if (va < 0x10000) {
+				return -E_INVAL;
+			}
+			if ((r = env_load_page(curenv, va)) < 0) {
+				return r;
+			}
+			if (r == 0) {
+				if ((r = swap_page_alloc(&p, PA_ZERO)) < 0) {
+					return r;
+				}
+				if ((r = page_insert(curenv->env_pgdir, p, va, PTE_R)) < 0) {
+					page_free(p);
+					return r;
+				}
+				curenv_stats->es_zero_faults++;
+			}
+			p = page_lookup(curenv->env_pgdir, va, &pte);
+		}
+		if (p != NULL && (*pte & PTE_COW)) {
+			if ((r = page_cow_fault(curenv->env_pgdir, va)) < 0) {
+				return r;
+			}
+			p = page_lookup(curenv->env_pgdir, va, &pte);
+		}
+		if (p == NULL || !(*pte & PTE_R)) {
+			return -E_INVAL;
+		}
+
+		bcopy(src, (void *)(page2kva(p) + (dstva - va)), n);
+		src = (const char *)src + n;
+		dstva += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Overview:
+ *  Copy the fault counters of env `envid` (0 for curenv) to `st`. Any env
+ *  may be asked about, so that a tool can rank them all.
+ *
+ * Post-Condition:
+ *  Return 0 on success, < 0 if `envid` is not a live env or `st` isn't
+ *  a writable user address.
+ */
+int sys_env_stats(int sysno, u_int envid, struct Env_stats *st)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)) < 0) {
+		return r;
+	}
+	return copyout((u_long)st, &e->env_stats, sizeof(struct Env_stats));
+}
 
 int sys_set_env_status(int sysno, u_int envid, u_int status)
 {
@@ -87,12 +219,111 @@ void sys_panic(int sysno, char *msg)
 
 }
 
+/* Overview:
+ *  Wait for a message, and for a page to be mapped at `dstva` if it is
+ *  not 0. curenv blocks until a sender delivers, and doesn't run meanwhile.
+ */
 void sys_ipc_recv(int sysno, u_int dstva)
 {
+	if (dstva >= UTOP) {
+		return;
+	}
 
+	curenv->env_ipc_recving = 1;
+	curenv->env_ipc_dstva = dstva;
+	wq_wake_one(&curenv->env_ipc_senders);
+	wq_wait(&curenv->env_ipc_wait);
 }
 
+/* Overview:
+ *  Send `value`, and the page at `srcva` with `perm` if `srcva` is not 0,
+ *  to env `envid`. A sender that comes before the receiver is ready blocks
+ *  until it is, instead of failing with -E_IPC_NOT_RECV. `perm` must have
+ *  PTE_V set and only PTE_R, PTE_COW and PTE_LIBRARY besides, and PTE_R
+ *  only if curenv may write the page itself.
+ *
+ * Post-Condition:
+ *  Return 0 on success, < 0 on error.
+ */
 int sys_ipc_can_send(int sysno, u_int envid, u_int value, u_int srcva, u_int perm)
 {
-    return 0;
+	struct Env *e;
+	struct Page *p;
+	struct Trapframe *tf;
+	Pte *pte;
+	int r;
+
+	if (srcva >= UTOP || (srcva & (BY2PG - 1)) != 0) {
+		return -E_INVAL;
+	}
+	if (srcva != 0 &&
+		((perm & PTE_V) == 0 || (perm & ~(PTE_V | PTE_R | PTE_COW | PTE_LIBRARY)) != 0)) {
+		return -E_INVAL;
+	}
+	if ((r = envid2env(envid, &e, 0)) < 0) {
+		return r;
+	}
+	/* It would wait for itself to receive. */
+	if (e == curenv) {
+		return -E_INVAL;
+	}
+
+	/* Step 1: Wait for `e` to receive, then run this syscall again. */
+	if (!e->env_ipc_recving) {
+		tf = (struct Trapframe *)(KERNEL_SP - sizeof(struct Trapframe));
+		tf->cp0_epc -= 4;
+		wq_wait(&e->env_ipc_senders);
+	}
+
+	/* Step 2: Map the page, which may have been swapped out. */
+	e->env_ipc_perm = 0;
+	if (srcva != 0 && e->env_ipc_dstva != 0) {
+		swap_in(curenv->env_pgdir, srcva);
+		if ((p = page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL) {
+			return -E_INVAL;
+		}
+		if ((perm & PTE_R) && (*pte & PTE_R) == 0) {
+			return -E_INVAL;
+		}
+		/* A copy-on-write PTE keeps PTE_R, but the page may be the zero
+		 * page, the program image or shared with a fork child. Before it
+		 * is shared writable, curenv takes its private copy. */
+		if ((perm & PTE_R) && (*pte & PTE_COW)) {
+			if ((r = page_cow_fault(curenv->env_pgdir, srcva)) < 0) {
+				return r;
+			}
+			p = page_lookup(curenv->env_pgdir, srcva, &pte);
+		}
+		if ((perm & PTE_R) && (p->pp_flags & PG_RESERVED)) {
+			return -E_INVAL;
+		}
+		if ((r = page_insert(e->env_pgdir, p, e->env_ipc_dstva, perm)) < 0) {
+			return r;
+		}
+		e->env_ipc_perm = perm;
+	}
+
+	/* Step 3: Hand over the value and wake the receiver up. */
+	e->env_ipc_recving = 0;
+	e->env_ipc_from = curenv->env_id;
+	e->env_ipc_value = value;
+	wq_wake_one(&e->env_ipc_wait);
+	return 0;
+}
+
+/* Overview:
+ *  Return the next character typed on the console. curenv blocks until
+ *  there is one, and runs this syscall again then.
+ */
+int sys_cgetc(int sysno)
+{
+	struct Trapframe *tf;
+	int c;
+
+	if ((c = cons_getc()) == 0) {
+		tf = (struct Trapframe *)(KERNEL_SP - sizeof(struct Trapframe));
+		tf->cp0_epc -= 4;
+		wq_wait(&cons_wait);
+	}
+	return c;
 }
@@ -1,6 +1,7 @@
 #include <trap.h>
 #include <env.h>
 #include <printf.h>
+#include <pmap.h>
 
 extern void handle_int();
 extern void handle_reserved();
@@ -49,6 +50,15 @@ page_fault_handler(struct Trapframe *tf)
 	extern struct Env * curenv;
 //printf("^^^^cp0_BadVAddress:%x\n",tf->cp0_badvaddr);
 
+	/* Copy-on-write pages (the zero page, program images, pages shared by
+	 * sys_env_fork) are resolved right here, the env's own handler only
+	 * sees the faults the kernel can't. */
+	curenv->env_stats.es_mod_faults++;
+	if (page_cow_fault(curenv->env_pgdir, tf->cp0_badvaddr) == 0) {
+		curenv->env_stats.es_cow_faults++;
+		return;
+	}
+
 	
 	bcopy(tf, &PgTrapFrame,sizeof(struct Trapframe));
 	if(tf->regs[29] >= (curenv->env_xstacktop - BY2PG) && tf->regs[29] <= (curenv->env_xstacktop - 1))
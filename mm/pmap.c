@@ -3,6 +3,10 @@
 #include "printf.h"
 #include "env.h"
 #include "error.h"
+#include "bitops.h"
+#include "kclock.h"
+#include "rmap.h"
+#include "swap.h"
 
 
 /* These variables are set by mips_detect_memory() */
@@ -16,10 +20,36 @@ Pde *boot_pgdir;
 struct Page *pages;
 static u_long freemem;
 
-static struct Page_list page_free_list; /* Free list of physical pages */
+/* One page of zeros, mapped copy-on-write wherever anonymous memory is read
+ * before it is ever written. */
+struct Page *zero_page;
+
+/* Buddy free lists: page_free_area[k] holds free blocks of 2^k pages. */
+static struct Page_list page_free_area[PAGE_MAX_ORDER];
+
+/* Single pages cleared ahead of time by page_zero_idle. They are taken off
+ * the buddy lists, so they have to be drained back before a large block
+ * can be built out of them. */
+static struct Page_list page_zero_list;
+static u_long page_zero_count;
+
+/* Lazy free memory: pages from `page_lazy_ppn` up to `npage` are free but
+ * have never been handed to the buddy lists, and their struct Page hasn't
+ * even been initialized yet. buddy_alloc carves blocks off this cursor only
+ * once the lists run dry. */
+static u_long page_lazy_ppn;
+static int page_lazy_held;	// set by page_steal_free: don't carve any more
+
+/* One bit per physical page, set while the page is handed out (or reserved
+ * below `freemem`), so free memory can be scanned a word at a time. Kept
+ * next to an exact count of free pages, including the pre-zeroed pool and
+ * the memory past `page_lazy_ppn`. */
+static u_int *page_bitmap;
+static u_long page_nr_free;
+static u_long page_free_blocks[PAGE_MAX_ORDER];
 
 void count_page(Pde* pgdir, int *cnt, int size){
-    int i;
+    int i, j;
     for(i=0; i < size; i++){
         cnt[i]=0;
     }
@@ -36,7 +66,7 @@ void count_page(Pde* pgdir, int *cnt, int size){
         if((*pgdir_entryp & PTE_V) != 0){
             pa = PADDR(PTE_ADDR(*pgdir_entryp));
             cnt[PPN(pa)]++;
-            pgtable = (Pte*)KADDR(PTE_ADDR(*pgdir[i]));
+            pgtable = (Pte*)KADDR(PTE_ADDR(pgdir[i]));
             for(j = 0; j < 1024; j++) {
                 Pte *pgtable_entry = pgtable + j;
                 if((*pgtable_entry & PTE_V) != 0) {
@@ -127,6 +157,44 @@ static void *alloc(u_int n, u_int align, int clear)
     then create it.*/
 // 虚拟地址-》创建一个新页表-》申请物理内存放页表-》返回页表入口
 // 直接使用 alloc 函数以字节为单位进行物理内存的分配
+/* Overview:
+    Mark directory entry `pdx` of `pgdir` as holding a page table or not,
+    in its Pgdir_info. */
+static void
+pgdir_track(Pde *pgdir, u_int pdx, int used)
+{
+    struct Pgdir_info *info = pgdir_info(pgdir);
+
+    if (used) {
+        info->pi_pdemap[pdx >> 5] |= 1 << (pdx & 31);
+    } else {
+        info->pi_pdemap[pdx >> 5] &= ~(1 << (pdx & 31));
+        info->pi_count[pdx] = 0;
+    }
+}
+
+/* Overview:
+    Free the page table behind directory entry `pdx` of `pgdir` once its
+    last valid PTE is gone. The table page is also mapped into the env's
+    own UVPT window, so that TLB entry goes as well. boot_pgdir keeps its
+    tables: the kernel's mappings are never torn down. */
+static void
+pgdir_put_table(Pde *pgdir, u_int pdx)
+{
+    u_long pa;
+
+    if (pgdir == boot_pgdir || pgdir_info(pgdir)->pi_count[pdx] != 0 ||
+        !(pgdir[pdx] & PTE_V)) {
+        return;
+    }
+
+    pa = PTE_ADDR(pgdir[pdx]);
+    pgdir[pdx] = 0;
+    pgdir_track(pgdir, pdx, 0);
+    tlb_invalidate(pgdir, UVPT + (pdx << PGSHIFT));
+    page_decref(pa2page(pa));
+}
+
 static Pte *boot_pgdir_walk(Pde *pgdir, u_long va, int create)
 {   
     // 用于内核刚刚启动时
@@ -153,6 +221,7 @@ static Pte *boot_pgdir_walk(Pde *pgdir, u_long va, int create)
         Pte temp1 = (Pte)alloc(BY2PG,BY2PG,1);
         Pte temp2 = PADDR(temp1);
         *pgdir_entryp = temp2 | PTE_V;
+        pgdir_track(pgdir, PDX(va), 1);
     }
 
     // *pgdir_entryp = PADDR((Pte)alloc(BY2PG,BY2PG,1)) | PTE_V;
@@ -181,8 +250,8 @@ static Pte *boot_pgdir_walk(Pde *pgdir, u_long va, int create)
 // 将相应的物理页面地址填入对应虚拟地址的页表项中
 void boot_map_segment(Pde *pgdir, u_long va, u_long size, u_long pa, int perm)
 {
-    int i, va_temp;
-    Pte *pgtable_entry;
+    u_long i;
+    Pte *pgtable = 0;
 
     /* Step 1: Check if `size` is a multiple of BY2PG. */
     size = ROUND(size,BY2PG);
@@ -190,10 +259,17 @@ void boot_map_segment(Pde *pgdir, u_long va, u_long size, u_long pa, int perm)
     /* Step 2: Map virtual address space to physical address. */
     /* Hint: Use `boot_pgdir_walk` to get the page table entry of virtual address `va`. */
     // 把页表项的物理地址和上面的内容赋值好
+    // 每个页表只查找一次
 
-    for(i = 0;i < size;i += BY2PG){
-        pgtable_entry = boot_pgdir_walk(pgdir,va+i,1);
-        *pgtable_entry = PTE_ADDR((pa+i))|perm|PTE_V;
+    for(i = 0;i < size;){
+        if (pgtable == 0 || PTX(va + i) == 0) {
+            pgtable = boot_pgdir_walk(pgdir,va+i,1) - PTX(va + i);
+        }
+        if (!(pgtable[PTX(va + i)] & PTE_V)) {
+            pgdir_info(pgdir)->pi_count[PDX(va + i)]++;
+        }
+        pgtable[PTX(va + i)] = PTE_ADDR((pa+i))|perm|PTE_V;
+        i += BY2PG;
     }
 
 }
@@ -212,8 +288,9 @@ void mips_vm_init()
     Pde *pgdir;
     u_int n;
 
-    /* Step 1: Allocate a page for page directory(first level page table). */
-    pgdir = alloc(BY2PG, BY2PG, 1);
+    /* Step 1: Allocate a page for page directory(first level page table),
+     * followed by its Pgdir_info. */
+    pgdir = alloc(2 * BY2PG, BY2PG, 1);
     printf("to memory %x for struct page directory.\n", freemem);
     mCONTEXT = (int)pgdir;
 
@@ -224,17 +301,26 @@ void mips_vm_init()
      * physical address `pages` allocated before. For consideration of alignment,
      * you should round up the memory size before map. */
 
-    pages = (struct Page *)alloc(npage * sizeof(struct Page), BY2PG, 1);
+    /* Not cleared here: page_init only sets up the pages below `freemem`,
+     * the rest are filled in lazily as the allocator first reaches them. */
+    pages = (struct Page *)alloc(npage * sizeof(struct Page), BY2PG, 0);
     printf("to memory %x for struct Pages.\n", freemem);
     n = ROUND(npage * sizeof(struct Page), BY2PG);
-    boot_map_segment(pgdir, UPAGES, n, PADDR(pages), PTE_R);
+    /* Every env shares this mapping (env_setup_vm copies the directory
+     * entries above UTOP), so it's global: the refill path copies PTE_G
+     * into EntryLo and one TLB entry serves all ASIDs. */
+    boot_map_segment(pgdir, UPAGES, n, PADDR(pages), PTE_R | PTE_G);
+
+    /* Step 2.5: Allocate the allocation bitmap, one bit per page. It has to
+     * start out clear: page_init only sets the bits below `freemem`. */
+    page_bitmap = (u_int *)alloc(ROUND(npage, 32) / 8, BY2PG, 1);
 
     /* Step 3, Allocate proper size of physical memory for global array `envs`,
      * for process management. Then map the physical address to `UENVS`. */
 
     envs = (struct Env *)alloc(NENV * sizeof(struct Env), BY2PG, 1);
     n = ROUND(NENV * sizeof(struct Env), BY2PG);
-    boot_map_segment(pgdir, UENVS, n, PADDR(envs), PTE_R); 
+    boot_map_segment(pgdir, UENVS, n, PADDR(envs), PTE_R | PTE_G);
     /* UENVS和envs实际上都映射到了envs对应的物理地址！*/
     
     printf("pmap.c:\t mips vm init success\n");
@@ -242,36 +328,254 @@ void mips_vm_init()
 
 }
 
+/* Overview:
+    Push the free block of 2^`order` pages headed by `pp` onto its buddy list. */
+static void buddy_push(struct Page *pp, u_int order)
+{
+    pp->pp_order = order;
+    pp->pp_flags |= PG_FREE;
+    LIST_INSERT_HEAD(&page_free_area[order], pp, pp_link);
+    page_free_blocks[order]++;
+}
+
+/* Overview:
+    Take the free block headed by `pp` off its buddy list. */
+static void buddy_pop(struct Page *pp)
+{
+    LIST_REMOVE(pp, pp_link);
+    pp->pp_flags &= ~PG_FREE;
+    page_free_blocks[pp->pp_order]--;
+}
+
+/* Overview:
+    Return the largest order of a buddy block which can start at page
+    `ppn` and doesn't run past page `end`. */
+static u_int buddy_fit_order(u_long ppn, u_long end)
+{
+    u_int order = 0;
+
+    while (order < PAGE_MAX_ORDER - 1 &&
+           (ppn & (1 << order)) == 0 &&
+           ppn + (2 << order) <= end) {
+        order++;
+    }
+    return order;
+}
+
+static void buddy_free(struct Page *pp, u_int order);
+
+/* Overview:
+    Carve the next block off the lazy cursor: initialize its struct Page
+    entries and give it to the buddy lists.
+
+  Post-Condition:
+    Return 0, or -E_NO_MEM if every page has already been carved, or the
+    checks hold the cursor (see page_steal_free). */
+static int buddy_grow(void)
+{
+    u_long ppn, i;
+    u_int order;
+
+    if (page_lazy_held || page_lazy_ppn >= npage) {
+        return -E_NO_MEM;
+    }
+
+    ppn = page_lazy_ppn;
+    order = buddy_fit_order(ppn, npage);
+    for (i = 0; i < (1 << order); i++) {
+        pages[ppn + i].pp_ref = 0;
+        pages[ppn + i].pp_order = 0;
+        pages[ppn + i].pp_flags = 0;
+        pages[ppn + i].pp_rmap = NULL;
+    }
+    page_lazy_ppn = ppn + (1 << order);
+    buddy_free(&pages[ppn], order);
+    return 0;
+}
+
+/* Overview:
+    Get a block of 2^`order` pages from the buddy lists, splitting a larger
+    block if there is no free block of exactly this order.
+
+  Post-Condition:
+    Return the first page of the block, or NULL if there's no large enough
+    free block. The block is NOT cleared. */
+static struct Page *buddy_alloc(u_int order)
+{
+    struct Page *pp;
+    u_int k;
+
+    /* Step 1: Find the smallest non-empty list which can satisfy `order`,
+     * pulling fresh blocks off the lazy cursor while there are none. */
+    for (;;) {
+        for (k = order; k < PAGE_MAX_ORDER; k++) {
+            if (!LIST_EMPTY(&page_free_area[k])) {
+                break;
+            }
+        }
+        if (k < PAGE_MAX_ORDER) {
+            break;
+        }
+        if (buddy_grow() < 0) {
+            return NULL;
+        }
+    }
+
+    pp = LIST_FIRST(&page_free_area[k]);
+    buddy_pop(pp);
+
+    /* Step 2: Split it, giving the upper halves back to the lower orders. */
+    while (k > order) {
+        k--;
+        buddy_push(pp + (1 << k), k);
+    }
+    pp->pp_order = order;
+    return pp;
+}
+
+/* Overview:
+    Give the block of 2^`order` pages headed by `pp` back to the buddy lists,
+    merging it with its buddy as long as the buddy is a free block of the
+    same order. */
+static void buddy_free(struct Page *pp, u_int order)
+{
+    u_long ppn, buddy;
+
+    ppn = page2ppn(pp);
+    while (order < PAGE_MAX_ORDER - 1) {
+        buddy = ppn ^ (1 << order);
+        if (buddy >= page_lazy_ppn) {
+            break;      /* not carved yet, its struct Page is garbage */
+        }
+        if (!(pages[buddy].pp_flags & PG_FREE) || pages[buddy].pp_order != order) {
+            break;
+        }
+        buddy_pop(&pages[buddy]);
+        ppn &= ~(1 << order);
+        order++;
+    }
+    buddy_push(&pages[ppn], order);
+}
+
+/* Overview:
+    Set (`used` != 0) or clear the bitmap bits of pages [ppn, ppn+n),
+    whole words at a time where the range allows it. */
+static void page_bitmap_set(u_long ppn, u_long n, int used)
+{
+    u_long end = ppn + n;
+    u_int mask;
+
+    while (ppn < end) {
+        if ((ppn & 31) == 0 && end - ppn >= 32) {
+            page_bitmap[ppn >> 5] = used ? ~0 : 0;
+            ppn += 32;
+            continue;
+        }
+        mask = 1 << (ppn & 31);
+        if (used) {
+            page_bitmap[ppn >> 5] |= mask;
+        } else {
+            page_bitmap[ppn >> 5] &= ~mask;
+        }
+        ppn++;
+    }
+}
+
+/* Overview:
+    Account for the block of 2^`order` pages headed by `pp` being handed
+    out (`used` != 0) or given back. */
+static void page_account(struct Page *pp, u_int order, int used)
+{
+    page_bitmap_set(page2ppn(pp), 1 << order, used);
+    if (used) {
+        page_nr_free -= 1 << order;
+    } else {
+        page_nr_free += 1 << order;
+    }
+}
+
 /*Overview:
     Initialize page structure and memory free list.
     The `pages` array has one `struct Page` entry per physical page. Pages
-    are reference counted, and free pages are kept on a linked list.
+    are reference counted, and free pages are kept on the buddy lists as
+    naturally aligned blocks of 2^order pages, which are only built as the
+    allocator first needs them.
   Hint:
     Use `LIST_INSERT_HEAD` to insert something to list.*/
 void
 page_init(void)
 {
-    /* Step 1: Initialize page_free_list. */
+    int i;
+
+    /* Step 1: Initialize the buddy free lists. */
     /* Hint: Use macro `LIST_INIT` defined in include/queue.h. */
-    LIST_INIT(&page_free_list);//because page_free_list is just a struct,but not point.
+    for (i = 0; i < PAGE_MAX_ORDER; i++) {
+        LIST_INIT(&page_free_area[i]);
+    }
+    LIST_INIT(&page_zero_list);
+    page_zero_count = 0;
 
     /* Step 2: Align `freemem` up to multiple of BY2PG. */
     freemem = ROUND(freemem,BY2PG);
 
     /* Step 3: Mark all memory blow `freemem` as used(set `pp_ref`
      * filed to 1) */
-    int i;
     int sum = PADDR(freemem) / BY2PG;
     for (i = 0; i < sum; i++){
         pages[i].pp_ref = 1;
+        pages[i].pp_order = 0;
+        pages[i].pp_flags = PG_RESERVED;
+        pages[i].pp_rmap = NULL;
+    }
+
+    /* Step 4: Mark the other memory as free. Nothing is put on the buddy
+     * lists yet, buddy_grow carves it off `page_lazy_ppn` when needed, so
+     * this doesn't depend on how much memory there is. */
+    page_lazy_ppn = sum;
+    page_nr_free = npage - sum;
+    for (i = 0; i < PAGE_MAX_ORDER; i++) {
+        page_free_blocks[i] = 0;
+    }
+    page_bitmap_set(0, sum, 1);
+
+    /* Step 5: Set up the shared zero page. Its references may come and go
+     * (and `pp_ref` may even wrap), it's never freed. */
+    if (page_alloc(&zero_page) < 0) {
+        panic("page_init: can't allocate the zero page");
     }
-    /* Step 4: Mark the other memory as free. */
-    for(i = sum;i < npage; i++){
-        pages[i].pp_ref = 0;
-        LIST_INSERT_HEAD(&page_free_list, &pages[i], pp_link); 
-    }   
+    zero_page->pp_ref = 1;
+    zero_page->pp_flags |= PG_RESERVED;
+
+    /* Step 6: Set up the reverse map, now that pages can be allocated. */
+    rmap_init();
+}
+
+
+/* Overview:
+    Take a page off the pre-zeroed pool, or return NULL if it's empty. */
+static struct Page *page_zero_pop(void)
+{
+    struct Page *pp;
+
+    if ((pp = LIST_FIRST(&page_zero_list)) != NULL) {
+        LIST_REMOVE(pp, pp_link);
+        pp->pp_flags &= ~PG_ZERO;
+        page_zero_count--;
+    }
+    return pp;
 }
 
+/* Overview:
+    Give every pre-zeroed page back to the buddy lists so they can merge
+    into larger blocks again. */
+static void page_zero_drain(void)
+{
+    struct Page *pp;
+
+    while ((pp = page_zero_pop()) != NULL) {
+        buddy_free(pp, 0);
+    }
+}
 
 /*Overview:
     Allocates a physical page from free memory, and clear this page.
@@ -283,44 +587,130 @@ page_init(void)
 
   Note:
     Does NOT increment the reference count of the page - the caller must do
-    these if necessary (either explicitly or via page_insert).
-
-  Hint:
-    Use LIST_FIRST and LIST_REMOVE defined in include/queue.h .*/
+    these if necessary (either explicitly or via page_insert).*/
 int
 page_alloc(struct Page **pp)    /* 传入page *pp的地址才能修改它 **pp=page address, *pp:page */
 { 
+    return page_alloc_flags(pp, PA_ZERO);
+}
+
+/*Overview:
+    Allocates a physical page like page_alloc, but lets the caller say
+    whether the page has to be cleared.
+    With PA_ZERO (the default) a page from the pre-zeroed pool is preferred,
+    and only if the pool is empty is a free page cleared here.
+    With PA_NOZERO the caller promises to overwrite the whole page, so a
+    dirty page is handed out and the pool is kept for those who need it.
+
+  Post-Condition:
+    Return 0 and set *pp on success, or -E_NO_MEM if there's no free page.*/
+int
+page_alloc_flags(struct Page **pp, int flags)
+{
     struct Page *ppage_temp;
 
-    /* Step 1: Get a page from free memory. If fails, return the error code.*/
-    if((ppage_temp=LIST_FIRST(&page_free_list)) != NULL) {
-        *pp = ppage_temp;
-        LIST_REMOVE(ppage_temp,pp_link); // LIST_REMOVE(elm, field)
-         /* Step 2: Initialize this page.
-            * Hint: use `bzero`. */
-        //u_long pa_pp = page2pa(ppage_temp); // page2pa(struct Page *pp)
-        //u_long va_pp = KADDR(pa_pp); // page2kva(struct Page *pp)
-        bzero((void *)page2kva(*pp),BY2PG);
-        //bzero((void *)va_pp, BY2PG);        // bzero((void *)alloced_mem, n); 
-        return 0;
+    if (!(flags & PA_NOZERO) && (ppage_temp = page_zero_pop()) != NULL) {
+        goto found;
+    }
+
+    if ((ppage_temp = buddy_alloc(0)) != NULL) {
+        if (!(flags & PA_NOZERO)) {
+            bzero((void *)page2kva(ppage_temp), BY2PG);
+        }
+        goto found;
+    }
+
+    /* Running low: a dirty caller may still eat into the zeroed pool. */
+    if ((ppage_temp = page_zero_pop()) != NULL) {
+        goto found;
+    }
+    return -E_NO_MEM;
+
+found:
+    page_account(ppage_temp, 0, 1);
+    curenv_stats->es_pages++;
+    *pp = ppage_temp;
+    return 0;
+}
+
+/*Overview:
+    Allocates 2^`order` physically contiguous pages, naturally aligned to
+    their size, and clear them.
+
+  Post-Condition:
+    If there's no free block large enough, return -E_NO_MEM.
+    Else, set the first page of the block to *pp, and return 0. Only this
+    first page carries `pp_ref` and `pp_order` for the whole block, and
+    the block must be released with page_free_order (or page_free once
+    `pp_ref` drops to 0).*/
+int
+page_alloc_order(u_int order, struct Page **pp)
+{
+    struct Page *ppage_temp;
+
+    if (order >= PAGE_MAX_ORDER) {
+        return -E_INVAL;
+    }
+
+    /* Step 1: Get a block from the buddy lists. The pre-zeroed pool may be
+     * holding the pages it needs, so drain it and retry before giving up. */
+    if ((ppage_temp = buddy_alloc(order)) == NULL) {
+        page_zero_drain();
+        if ((ppage_temp = buddy_alloc(order)) == NULL) {
+            return -E_NO_MEM;
+        }
+    }
+
+    /* Step 2: Initialize this block.
+     * Hint: use `bzero`. */
+    bzero((void *)page2kva(ppage_temp), BY2PG << order);
+    page_account(ppage_temp, order, 1);
+    curenv_stats->es_pages += 1 << order;
+    *pp = ppage_temp;
+    return 0;
+}
+
+/*Overview:
+    Clear up to `budget` free pages into the pre-zeroed pool, so that later
+    page_alloc calls don't have to. Meant to be called when the scheduler
+    has nothing to run.
+
+  Post-Condition:
+    Return the number of pages cleared.*/
+int
+page_zero_idle(int budget)
+{
+    struct Page *pp;
+    int n = 0;
+
+    while (n < budget && page_zero_count < PAGE_ZERO_POOL_MAX) {
+        if ((pp = buddy_alloc(0)) == NULL) {
+            break;
+        }
+        bzero((void *)page2kva(pp), BY2PG);
+        pp->pp_flags |= PG_ZERO;
+        LIST_INSERT_HEAD(&page_zero_list, pp, pp_link);
+        page_zero_count++;
+        n++;
     }
-    return -E_NO_MEM;   
+    return n;
 }
 
 /*Overview:
     Release a page, mark it as free if it's `pp_ref` reaches 0.
   Hint:
-    When to free a page, just insert it to the page_free_list.*/
+    When to free a page, just give the block it heads back to the buddy lists.*/
 void
 page_free(struct Page *pp)
 {
     /* Step 1: If there's still virtual address refers to this page, do nothing. */
-    if (pp->pp_ref)
+    if (pp->pp_ref || (pp->pp_flags & PG_RESERVED))
         return;
 
     /* Step 2: If the `pp_ref` reaches to 0, mark this page as free and return. */
     else if (pp->pp_ref == 0) {
-        LIST_INSERT_HEAD(&page_free_list, pp, pp_link);
+        page_account(pp, pp->pp_order, 0);
+        buddy_free(pp, pp->pp_order);
         return;
     }
 
@@ -329,6 +719,67 @@ page_free(struct Page *pp)
     panic("cgh:pp->pp_ref is less than zero\n");
 }
 
+/*Overview:
+    Release the block of 2^`order` pages headed by `pp`, which must have been
+    returned by page_alloc_order with the same `order`.*/
+void
+page_free_order(struct Page *pp, u_int order)
+{
+    if (pp->pp_order != order) {
+        panic("page_free_order: block %x has order %d, not %d",
+              page2pa(pp), pp->pp_order, order);
+    }
+    if (pp->pp_ref) {
+        return;
+    }
+    page_account(pp, order, 0);
+    buddy_free(pp, order);
+}
+
+/*Overview:
+    Return the number of free pages, in O(1).*/
+u_long
+page_free_count(void)
+{
+    return page_nr_free;
+}
+
+/*Overview:
+    Return the first free page number at or after `ppn`, or `npage` if
+    there's none. Whole words of used pages are skipped at once.*/
+u_long
+page_next_free(u_long ppn)
+{
+    u_int word;
+
+    while (ppn < npage) {
+        word = ~page_bitmap[ppn >> 5] & (~0 << (ppn & 31));
+        if (word) {
+            ppn = (ppn & ~31) + ffs32(word);
+            return ppn < npage ? ppn : npage;
+        }
+        ppn = (ppn & ~31) + 32;
+    }
+    return npage;
+}
+
+/*Overview:
+    Fill `st` with a snapshot of the allocator. Cheap enough to be polled
+    from the timer path: it never walks the free lists.*/
+void
+page_stats(struct Page_stats *st)
+{
+    int i;
+
+    st->ps_total = npage;
+    st->ps_free = page_nr_free;
+    st->ps_zeroed = page_zero_count;
+    st->ps_uncarved = npage - page_lazy_ppn;
+    for (i = 0; i < PAGE_MAX_ORDER; i++) {
+        st->ps_blocks[i] = page_free_blocks[i];
+    }
+}
+
 /*Overview:
     Given `pgdir`, a pointer to a page directory, pgdir_walk returns a pointer
     to the page table entry (with permission PTE_R|PTE_V) for virtual address 'va'.
@@ -339,7 +790,8 @@ page_free(struct Page *pp)
   Post-Condition:
     If we're out of memory, return -E_NO_MEM.
     Else, we get the page table entry successfully, store the value of page table
-    entry to *ppte, and return 0, indicating success.
+    entry to *ppte, and return 0, indicating success. If there's no page table
+    and `create` isn't set, *ppte is 0.
 
   Hint:
     We use a two-level pointer to store page table entry and return a state code to indicate
@@ -368,11 +820,16 @@ pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte)
         } else {
             *pgdir_entryp = page2pa(ppage)|PTE_V|PTE_R;
             ppage->pp_ref++;
+            pgdir_track(pgdir, PDX(va), 1);
         }
     }
     
     /* Step 3: Set the page table entry to `*ppte` as return value. */
     
+    if (!(*pgdir_entryp & PTE_V)) {
+        *ppte = 0;
+        return 0;
+    }
     pgtable = (Pte*)KADDR(PTE_ADDR(*pgdir_entryp));
     Pte *pgtable_entry = &pgtable[PTX(va)];
     *ppte = pgtable_entry;
@@ -380,6 +837,24 @@ pgdir_walk(Pde *pgdir, u_long va, int create, Pte **ppte)
     return 0;
 }
 
+/*Overview:
+    If '*pte' (the entry of 'va' in 'pgdir') holds a swapped-out page,
+    release its swap slot and clear it.
+
+  Post-Condition:
+    Return 1 if it did, 0 otherwise.*/
+static int
+pte_drop_swap(Pde *pgdir, u_long va, Pte *pte)
+{
+    if (pte == 0 || !(*pte & PTE_SWAP)) {
+        return 0;
+    }
+    swap_drop(*pte);
+    *pte = 0;
+    pgdir_info(pgdir)->pi_count[PDX(va)]--;
+    return 1;
+}
+
 /*Overview:
     Map the physical page 'pp' at virtual address 'va'.
     The permissions (the low 12 bits) of the page table entry should be set to 'perm|PTE_V'.
@@ -396,14 +871,26 @@ page_insert(Pde *pgdir, struct Page *pp, u_long va, u_int perm)
 {
     u_int PERM;
     Pte *pgtable_entry;
+    int r;
     PERM = perm | PTE_V;
 
     /* Step 1: Get corresponding page table entry. */
     pgdir_walk(pgdir, va, 0, &pgtable_entry); // 返回一个页表项入口
+    pte_drop_swap(pgdir, va, pgtable_entry);
 
     if (pgtable_entry != 0 && (*pgtable_entry & PTE_V) != 0) {
         if (pa2page(*pgtable_entry) != pp) {
-            page_remove(pgdir, va);
+            /* Replace the old page in place, rather than with page_remove:
+             * the page table mustn't go empty (and be freed) in between. */
+            if ((r = rmap_add(pp, pgdir, va)) < 0) {
+                return r;
+            }
+            rmap_del(pa2page(*pgtable_entry), pgdir, va);
+            pp->pp_ref++;
+            page_decref(pa2page(*pgtable_entry));
+            *pgtable_entry = (page2pa(pp) | PERM);
+            tlb_invalidate(pgdir, va);
+            return 0;
         } else  {
             tlb_invalidate(pgdir, va);
             *pgtable_entry = (page2pa(pp) | PERM);
@@ -417,13 +904,18 @@ page_insert(Pde *pgdir, struct Page *pp, u_long va, u_int perm)
     /* Step 3: Do check, re-get page table entry to validate the insertion. */
     /* Step 3.1 Check if the page can be insert, if can’t return -E_NO_MEM */
     
-    if (pgdir_walk(pgdir, va, 1, &pgtable_entry) != 0) {
-        return -E_NO_MEM;    // panic ("page insert failed .\n");
+    if ((r = pgdir_walk(pgdir, va, 1, &pgtable_entry)) != 0) {
+        return r;    // panic ("page insert failed .\n");
+    }
+    if ((r = rmap_add(pp, pgdir, va)) < 0) {
+        pgdir_put_table(pgdir, PDX(va));
+        return r;
     }
     
     /* Step 3.2 Insert page and increment the pp_ref */
     *pgtable_entry = (page2pa(pp) | PERM);
     pp->pp_ref++;   
+    pgdir_info(pgdir)->pi_count[PDX(va)]++;
     
     return 0;
 }
@@ -482,12 +974,18 @@ page_remove(Pde *pgdir, u_long va)
     ppage = page_lookup(pgdir, va, &pagetable_entry);
 
     if (ppage == 0) {
+        /* Nothing mapped, but a swapped-out page still holds a slot. */
+        pgdir_walk(pgdir, va, 0, &pagetable_entry);
+        if (pte_drop_swap(pgdir, va, pagetable_entry)) {
+            pgdir_put_table(pgdir, PDX(va));
+        }
         return;
     }
 
     /* Step 2: Decrease `pp_ref` and decide if it's necessary to free this page. */
 
     /* Hint: When there's no virtual address mapped to this page, release it. */
+    rmap_del(ppage, pgdir, va);
     ppage->pp_ref--;
     if (ppage->pp_ref == 0) {
         page_free(ppage);
@@ -495,20 +993,400 @@ page_remove(Pde *pgdir, u_long va)
 
     /* Step 3: Update TLB. */
     *pagetable_entry = 0;
+    pgdir_info(pgdir)->pi_count[PDX(va)]--;
     tlb_invalidate(pgdir, va);
+    pgdir_put_table(pgdir, PDX(va));
     return;
 }
 
+/*Overview:
+    Return the first directory entry at or after `pdx` that holds a page
+    table, or 1024 if there's none. Whole words of empty entries are
+    skipped at once.*/
+u_int
+pgdir_next_table(Pde *pgdir, u_int pdx)
+{
+    struct Pgdir_info *info = pgdir_info(pgdir);
+    u_int word;
+
+    while (pdx < 1024) {
+        word = info->pi_pdemap[pdx >> 5] & (~0 << (pdx & 31));
+        if (word) {
+            return (pdx & ~31) + ffs32(word);
+        }
+        pdx = (pdx & ~31) + 32;
+    }
+    return 1024;
+}
+
+/*Overview:
+    Map the 'n' pages of 'pages' at the consecutive pages starting at 'va',
+    all with 'perm'. Unlike a page_insert per page, each page table is
+    walked once, and only PTEs that were valid before get their TLB entry
+    invalidated.
+
+  Pre-Condition:
+    'va' is 4KB aligned.
+
+    TLB invalidations are batched (see tlb_batch_begin).
+
+  Post-Condition:
+    Return the number of pages mapped. Fewer than 'n' means -E_NO_MEM:
+    pages[0..ret) are mapped, the rest aren't touched.*/
+int
+page_map_range(Pde *pgdir, u_long va, struct Page **pages, u_int n, u_int perm)
+{
+    Pte *pgtable = 0;
+    Pte *pte;
+    struct Page *old;
+    u_int i;
+
+    tlb_batch_begin(pgdir);
+    for (i = 0; i < n; i++, va += BY2PG) {
+        /* Step 1: Walk the directory at the start and at every new table. */
+        if (pgtable == 0 || PTX(va) == 0) {
+            if (pgdir_walk(pgdir, va, 1, &pte) < 0) {
+                break;
+            }
+            pgtable = pte - PTX(va);
+        }
+        pte = &pgtable[PTX(va)];
+        pte_drop_swap(pgdir, va, pte);
+        old = (*pte & PTE_V) ? pa2page(*pte) : 0;
+        if (old != pages[i]) {
+            if (rmap_add(pages[i], pgdir, va) < 0) {
+                pgdir_put_table(pgdir, PDX(va));
+                break;
+            }
+            if (old) {
+                rmap_del(old, pgdir, va);
+            }
+        }
+
+        /* Step 2: Take the reference before dropping the old one, the
+         * page may be mapped here already. */
+        pages[i]->pp_ref++;
+        *pte = page2pa(pages[i]) | perm | PTE_V;
+        if (old) {
+            tlb_invalidate(pgdir, va);
+            page_decref(old);
+        } else {
+            pgdir_info(pgdir)->pi_count[PDX(va)]++;
+        }
+    }
+    tlb_batch_end(pgdir);
+    return i;
+}
+
+/*Overview:
+    Unmap every page in ['va', 'va' + 'len') and drop its reference.
+    Each page table is walked once and missing ones are skipped whole.
+
+  Pre-Condition:
+    'va' and 'len' are 4KB aligned.*/
+void
+page_unmap_range(Pde *pgdir, u_long va, u_long len)
+{
+    u_long end = va + len;
+    u_long next;
+    Pte *pgtable;
+    Pde pde;
+
+    tlb_batch_begin(pgdir);
+    for (; va < end; va = next) {
+        next = ROUNDDOWN(va, PDMAP) + PDMAP;
+        if (next > end || next == 0) {
+            next = end;
+        }
+
+        pde = pgdir[PDX(va)];
+        if (!(pde & PTE_V)) {
+            continue;
+        }
+
+        pgtable = (Pte *)KADDR(PTE_ADDR(pde));
+        for (; va < next; va += BY2PG) {
+            if (!(pgtable[PTX(va)] & PTE_V)) {
+                pte_drop_swap(pgdir, va, &pgtable[PTX(va)]);
+                continue;
+            }
+            rmap_del(pa2page(pgtable[PTX(va)]), pgdir, va);
+            page_decref(pa2page(pgtable[PTX(va)]));
+            pgtable[PTX(va)] = 0;
+            pgdir_info(pgdir)->pi_count[PDX(va)]--;
+            tlb_invalidate(pgdir, va);
+        }
+        pgdir_put_table(pgdir, PDX(next - BY2PG));
+    }
+    tlb_batch_end(pgdir);
+}
+
+/* ASIDs are handed out in generations. ASID 0 always belongs to
+ * boot_pgdir (the kernel before any env runs); 1 .. NASID-1 go to address
+ * spaces in turn as they run. Once they are used up, the whole TLB is
+ * flushed and a new generation starts: every address space gets a new
+ * ASID the next time it runs. An ASID is thus never shared, and switching
+ * address spaces never needs a flush. */
+#define NASID   64
+
+static u_int asid_generation = 1;   // 0 is what a fresh Pgdir_info holds
+static u_int asid_next = 1;
+
+/*Overview:
+    Return the ASID of 'pgdir', in its EntryHi position, giving it a new
+    one first if it has none in the current generation.*/
+u_int
+pgdir_asid(Pde *pgdir)
+{
+    struct Pgdir_info *info;
+
+    if (pgdir == boot_pgdir) {
+        return 0;
+    }
+
+    info = pgdir_info(pgdir);
+    if (info->pi_asid_gen != asid_generation) {
+        if (asid_next == NASID) {
+            if (++asid_generation == 0) {
+                asid_generation = 1;
+            }
+            asid_next = 1;
+            tlb_flush_all();
+        }
+        info->pi_asid = asid_next++ << 6;
+        info->pi_asid_gen = asid_generation;
+    }
+    return info->pi_asid;
+}
+
+extern int mCONTEXT;
+static struct Tlb_stats tlb_stat;
+
 // Overview:
 //  Update TLB.
+//  An address space without an ASID in the current generation has nothing
+//  in the TLB, so there's nothing to do for it. The entry of the running
+//  address space (mCONTEXT) is dropped right away, unless a batch is open
+//  on it. Any other address space can't use its entries before env_run,
+//  so they are only queued, and dropped by tlb_flush_pending.
 void
 tlb_invalidate(Pde *pgdir, u_long va)
 {
-    if (curenv) {
-        tlb_out(PTE_ADDR(va) | GET_ENV_ASID(curenv->env_id));
-    } else {
+    struct Pgdir_info *info;
+    u_int i;
+
+    if (pgdir == boot_pgdir) {
         tlb_out(PTE_ADDR(va));
+        return;
     }
+
+    info = pgdir_info(pgdir);
+    if (info->pi_asid_gen != asid_generation) {
+        return;
+    }
+    tlb_stat.ts_requests++;
+
+    if (info->pi_batch == 0 && pgdir == (Pde *)mCONTEXT) {
+        tlb_out(PTE_ADDR(va) | info->pi_asid);
+        tlb_stat.ts_probes++;
+        return;
+    }
+
+    /* Queue it, unless it's there already or the whole ASID goes anyway. */
+    if (info->pi_ninval > PGDIR_INVAL_MAX) {
+        return;
+    }
+    for (i = 0; i < info->pi_ninval; i++) {
+        if (info->pi_inval[i] == PTE_ADDR(va)) {
+            return;
+        }
+    }
+    if (info->pi_ninval < PGDIR_INVAL_MAX) {
+        info->pi_inval[info->pi_ninval] = PTE_ADDR(va);
+    }
+    info->pi_ninval++;
+}
+
+/*Overview:
+    Test and clear the stand-in for a referenced bit: whether the TLB
+    holds the entry of 'va' in 'pgdir'. An entry found is dropped right
+    away, so the next access refills it and sets the "bit" again.
+
+  Post-Condition:
+    Return 1 if the entry was in the TLB, 0 otherwise.*/
+int
+tlb_test_and_clear(Pde *pgdir, u_long va)
+{
+    struct Pgdir_info *info;
+    u_int entryhi;
+
+    if (pgdir == boot_pgdir) {
+        return 0;
+    }
+    info = pgdir_info(pgdir);
+    if (info->pi_asid_gen != asid_generation) {
+        return 0;
+    }
+
+    entryhi = PTE_ADDR(va) | info->pi_asid;
+    if (tlb_probe(entryhi) < 0) {
+        return 0;
+    }
+    tlb_out(entryhi);
+    return 1;
+}
+
+/*Overview:
+    Drop the TLB entries queued for 'pgdir': one by one, or with a single
+    tlb_flush_asid if the queue overflowed.*/
+void
+tlb_flush_pending(Pde *pgdir)
+{
+    struct Pgdir_info *info = pgdir_info(pgdir);
+    u_int i;
+
+    if (pgdir == boot_pgdir || info->pi_ninval == 0) {
+        return;
+    }
+
+    if (info->pi_asid_gen == asid_generation) {
+        if (info->pi_ninval > PGDIR_INVAL_MAX) {
+            tlb_flush_asid(info->pi_asid);
+            tlb_stat.ts_asid_flushes++;
+        } else {
+            for (i = 0; i < info->pi_ninval; i++) {
+                tlb_out(info->pi_inval[i] | info->pi_asid);
+            }
+            tlb_stat.ts_probes += info->pi_ninval;
+        }
+    }
+    info->pi_ninval = 0;
+}
+
+/*Overview:
+    Defer the TLB invalidations of 'pgdir' until the matching
+    tlb_batch_end, even if it's the running address space. Meanwhile,
+    the kernel mustn't touch the user addresses it changed. Batches nest.*/
+void
+tlb_batch_begin(Pde *pgdir)
+{
+    pgdir_info(pgdir)->pi_batch++;
+}
+
+void
+tlb_batch_end(Pde *pgdir)
+{
+    struct Pgdir_info *info = pgdir_info(pgdir);
+
+    if (--info->pi_batch == 0 && pgdir == (Pde *)mCONTEXT) {
+        tlb_flush_pending(pgdir);
+    }
+}
+
+void
+tlb_stats(struct Tlb_stats *st)
+{
+    *st = tlb_stat;
+}
+
+/* Whether handle_tlb may refill without saving any registers. */
+int tlb_refill_fast = 1;
+
+#define TLB_BENCH_VA        0x10000000  // nothing else there in boot_pgdir
+#define TLB_BENCH_PAGES     32
+#define TLB_BENCH_ROUNDS    256
+
+/* Overview:
+    Time TLB_BENCH_ROUNDS rounds of flushing the TLB and reading one word
+    of each of the TLB_BENCH_PAGES benchmark pages, in microseconds. */
+static u_int
+tlb_bench_run(int touch)
+{
+    u_int t, round, i;
+    volatile u_int sum = 0;
+
+    t = kclock_usec();
+    for (round = 0; round < TLB_BENCH_ROUNDS; round++) {
+        tlb_flush_all();
+        for (i = 0; touch && i < TLB_BENCH_PAGES; i++) {
+            sum += *(volatile u_int *)(TLB_BENCH_VA + i * BY2PG);
+        }
+    }
+    return kclock_usec() - t;
+}
+
+/* Overview:
+    Measure what a TLB refill costs on the fast path of handle_tlb and on
+    the full do_refill path, and print both. The R3000 has no cycle
+    counter, so the cost is given in nanoseconds (of the RTC) instead.
+    Run it after trap_init, before any env: the misses go to boot_pgdir.
+    mips_init only calls it in kernels built with -DTLB_BENCH. */
+void
+tlb_refill_bench(void)
+{
+    struct Page *pp[TLB_BENCH_PAGES];
+    u_int base, fast, slow, n, i;
+    u_long pa;
+
+    for (i = 0; i < TLB_BENCH_PAGES; i++) {
+        assert(page_alloc(&pp[i]) == 0);
+    }
+    assert(page_map_range(boot_pgdir, TLB_BENCH_VA, pp, TLB_BENCH_PAGES, 0) ==
+           TLB_BENCH_PAGES);
+
+    /* The flushes alone, to be taken off both. */
+    base = tlb_bench_run(0);
+    tlb_refill_fast = 1;
+    fast = tlb_bench_run(1) - base;
+    tlb_refill_fast = 0;
+    slow = tlb_bench_run(1) - base;
+    tlb_refill_fast = 1;
+
+    n = TLB_BENCH_ROUNDS * TLB_BENCH_PAGES;
+    printf("tlb_refill_bench:\t%d refills: fast path %d ns, do_refill %d ns each\n",
+           n, fast * 1000 / n, slow * 1000 / n);
+
+    /* pgdir_put_table keeps boot_pgdir's tables, but this one is ours. */
+    page_unmap_range(boot_pgdir, TLB_BENCH_VA, TLB_BENCH_PAGES * BY2PG);
+    pa = PTE_ADDR(boot_pgdir[PDX(TLB_BENCH_VA)]);
+    boot_pgdir[PDX(TLB_BENCH_VA)] = 0;
+    pgdir_track(boot_pgdir, PDX(TLB_BENCH_VA), 0);
+    page_decref(pa2page(pa));
+}
+
+/* Overview:
+    Move every free block off the buddy lists (and the pre-zeroed pool)
+    onto `fl`, so checks can run the allocator dry. Give them back with
+    page_return_free. The memory not carved yet stays where it is: the
+    cursor is only held still meanwhile, so a check at boot doesn't carve
+    all of memory. */
+static void page_steal_free(struct Page_list *fl)
+{
+    struct Page *pp;
+    int i;
+
+    page_lazy_held = 1;
+    LIST_INIT(fl);
+    while ((pp = page_zero_pop()) != NULL) {
+        LIST_INSERT_HEAD(fl, pp, pp_link);
+    }
+    for (i = 0; i < PAGE_MAX_ORDER; i++) {
+        while ((pp = LIST_FIRST(&page_free_area[i])) != NULL) {
+            buddy_pop(pp);
+            LIST_INSERT_HEAD(fl, pp, pp_link);
+        }
+    }
+}
+
+static void page_return_free(struct Page_list *fl)
+{
+    struct Page *pp;
+
+    while ((pp = LIST_FIRST(fl)) != NULL) {
+        LIST_REMOVE(pp, pp_link);
+        buddy_free(pp, pp->pp_order);
+    }
+    page_lazy_held = 0;
 }
 
 void
@@ -531,9 +1409,8 @@ physical_memory_manage_check(void)
 
 
     // temporarily steal the rest of the free pages
-    fl = page_free_list;
-    // now this page_free list must be empty!!!!
-    LIST_INIT(&page_free_list);
+    // now the buddy lists must be empty!!!!
+    page_steal_free(&fl);
     // should be no free memory
     assert(page_alloc(&pp) == -E_NO_MEM);
 
@@ -553,7 +1430,7 @@ physical_memory_manage_check(void)
     assert(*temp == 0);
 
     // pp0 should not change
-    page_free_list = fl;
+    page_return_free(&fl);
     page_free(pp0);
     page_free(pp1);
     page_free(pp2);
@@ -626,9 +1503,8 @@ page_check(void)
     assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
     // temporarily steal the rest of the free pages
-    fl = page_free_list;
-    // now this page_free list must be empty!!!!
-    LIST_INIT(&page_free_list);
+    // now the buddy lists must be empty!!!!
+    page_steal_free(&fl);
 
     // should be no free memory
     assert(page_alloc(&pp) == -E_NO_MEM);
@@ -710,7 +1586,7 @@ page_check(void)
     pp0->pp_ref = 0;
 
     // give free list back
-    page_free_list = fl;
+    page_return_free(&fl);
 
     // free the pages we took
     page_free(pp0);
@@ -720,9 +1596,211 @@ page_check(void)
     printf("page_check() succeeded!\n");
 }
 
-void pageout(int va, int context)
+void
+buddy_check(void)
+{
+    struct Page *pp, *pp0, *pp1, *pp2;
+    struct Page_list fl;
+    u_long nfree;
+
+    // an order-2 block is 4 contiguous, naturally aligned pages
+    nfree = page_free_count();
+    assert(page_alloc_order(2, &pp0) == 0);
+    assert((page2ppn(pp0) & 3) == 0);
+    assert(pp0->pp_order == 2);
+    assert(*(int *)(page2kva(pp0) + 3 * BY2PG) == 0);
+
+    // ... which the counter and the bitmap both account for
+    assert(page_free_count() == nfree - 4);
+    assert(page_next_free(page2ppn(pp0)) >= page2ppn(pp0) + 4);
+
+    // run the allocator dry, then hand the block back
+    page_steal_free(&fl);
+    assert(page_alloc(&pp) == -E_NO_MEM);
+    page_free_order(pp0, 2);
+
+    // the block should be split to serve single pages ...
+    assert(page_alloc(&pp1) == 0 && pp1 == pp0);
+    assert(page_alloc(&pp2) == 0 && pp2 != pp1);
+    assert(page_alloc_order(2, &pp) == -E_NO_MEM);
+    assert(page_alloc_order(1, &pp) == 0 && pp == pp0 + 2);
+    page_free_order(pp, 1);
+
+    // ... and coalesce back once both halves are free again
+    page_free(pp1);
+    page_free(pp2);
+    assert(page_alloc_order(2, &pp) == 0 && pp == pp0);
+    page_free_order(pp, 2);
+
+    page_return_free(&fl);
+    assert(page_free_count() == nfree);
+    printf("buddy_check() succeeded!\n");
+}
+
+/* Exception codes (Cause bits 6..2) of the two TLB miss exceptions. */
+#define EXC_TLBL    2   // miss on load or instruction fetch
+#define EXC_TLBS    3   // miss on store
+
+/*Overview:
+    Resolve a write to the copy-on-write page mapped at 'va' in 'pgdir':
+    give 'va' a private, writable copy of the page. A page that was never
+    written is the shared zero page, for which a cleared page will do, and
+    the last sharer of a page may just write to it.
+
+  Post-Condition:
+    Return 0 if the fault was resolved, -E_INVAL if 'va' isn't mapped
+    copy-on-write, or -E_NO_MEM.*/
+int
+page_cow_fault(Pde *pgdir, u_long va)
+{
+    struct Page *pp, *newpp;
+    Pte *pte;
+    u_int perm;
+    int r;
+
+    va = ROUNDDOWN(va, BY2PG);
+    if ((pp = page_lookup(pgdir, va, &pte)) == NULL || !(*pte & PTE_COW)) {
+        return -E_INVAL;
+    }
+    perm = (*pte & 0xfff & ~PTE_COW) | PTE_R;
+
+    /* The other sharers are all gone already: take the page over. */
+    if (pp->pp_ref == 1 && !(pp->pp_flags & PG_RESERVED)) {
+        *pte = page2pa(pp) | perm | PTE_V;
+        tlb_invalidate(pgdir, va);
+        return 0;
+    }
+
+    if (pp == zero_page) {
+        r = swap_page_alloc(&newpp, PA_ZERO);
+    } else {
+        if ((r = swap_page_alloc(&newpp, PA_NOZERO)) == 0) {
+            bcopy((void *)page2kva(pp), (void *)page2kva(newpp), BY2PG);
+        }
+    }
+    if (r < 0) {
+        return r;
+    }
+
+    /* page_insert drops the reference to the old page for us. */
+    return page_insert(pgdir, newpp, va, perm);
+}
+
+/*Overview:
+    Share all user pages of 'src' (below UTOP) with 'dst', for fork.
+    Writable pages, except PTE_LIBRARY ones, become copy-on-write in both,
+    so a page is only copied once one of the two writes to it.
+
+  Pre-Condition:
+    'src' is the page directory of curenv, whose TLB entries get flushed.
+
+  Post-Condition:
+    Return 0 on success, or -E_NO_MEM. Pages already shared stay shared
+    on failure.*/
+int
+page_fork(Pde *src, Pde *dst)
+{
+    u_long pdeno, pteno, va;
+    Pte *pt;
+    u_int perm;
+    int r = 0;
+
+    /* The parent's write permissions are all taken away in one go. */
+    tlb_batch_begin(src);
+    for (pdeno = pgdir_next_table(src, 0); pdeno < PDX(UTOP);
+         pdeno = pgdir_next_table(src, pdeno + 1)) {
+        pt = (Pte *)KADDR(PTE_ADDR(src[pdeno]));
+
+        for (pteno = 0; pteno <= PTX(~0); pteno++) {
+            va = (pdeno << PDSHIFT) | (pteno << PGSHIFT);
+            /* A swapped-out page comes back to be shared. */
+            if ((pt[pteno] & PTE_SWAP) && (r = swap_in(src, va)) < 0) {
+                goto out;
+            }
+            if (!(pt[pteno] & PTE_V)) {
+                continue;
+            }
+            perm = pt[pteno] & 0xfff;
+            if ((perm & PTE_R) && !(perm & PTE_LIBRARY) && !(perm & PTE_COW)) {
+                perm |= PTE_COW;
+                pt[pteno] |= PTE_COW;
+                tlb_invalidate(src, va);
+            }
+            if ((r = page_insert(dst, pa2page(pt[pteno]), va, perm)) < 0) {
+                goto out;
+            }
+        }
+    }
+out:
+    tlb_batch_end(src);
+    return r;
+}
+
+/* Number of mappings the reverse map holds for `pp`. */
+static int
+rmap_count(struct Page *pp)
 {
-    u_long r;
+    struct Rmap *rm;
+    int n = 0;
+
+    for (rm = pp->pp_rmap; rm != NULL; rm = rm->rm_next) {
+        n++;
+    }
+    return n;
+}
+
+void
+page_fork_check(void)
+{
+    struct Env *parent, *child;
+    struct Page *pp, *p0, *p1;
+    Pte *pte0, *pte1;
+    u_long va = 0x00400000;
+
+    assert(env_alloc(&parent, 0) == 0);
+    assert(env_alloc(&child, parent->env_id) == 0);
+    assert(page_alloc(&pp) == 0);
+    assert(page_insert(parent->env_pgdir, pp, va, PTE_R) == 0);
+    *(u_int *)page2kva(pp) = 0x1234;
+
+    // after the fork both share the page, copy-on-write
+    assert(page_fork(parent->env_pgdir, child->env_pgdir) == 0);
+    p0 = page_lookup(parent->env_pgdir, va, &pte0);
+    p1 = page_lookup(child->env_pgdir, va, &pte1);
+    assert(p0 == pp && p1 == pp && pp->pp_ref == 2 && rmap_count(pp) == 2);
+    assert((*pte0 & PTE_COW) && (*pte1 & PTE_COW));
+
+    // the child writes: it gets a copy, and the parent doesn't see its write
+    assert(page_cow_fault(child->env_pgdir, va) == 0);
+    p1 = page_lookup(child->env_pgdir, va, &pte1);
+    assert(p1 != pp && (*pte1 & PTE_R) && !(*pte1 & PTE_COW));
+    assert(pp->pp_ref == 1 && rmap_count(pp) == 1 && rmap_count(p1) == 1);
+    assert(*(u_int *)page2kva(p1) == 0x1234);
+    *(u_int *)page2kva(p1) = 0x5678;
+    assert(*(u_int *)page2kva(pp) == 0x1234);
+
+    // the parent, last one left, takes the page over without a copy
+    assert(page_cow_fault(parent->env_pgdir, va) == 0);
+    p0 = page_lookup(parent->env_pgdir, va, &pte0);
+    assert(p0 == pp && (*pte0 & PTE_R) && !(*pte0 & PTE_COW));
+    assert(page_cow_fault(parent->env_pgdir, va) == -E_INVAL);
+
+    env_free(child);
+    env_free(parent);
+    printf("page_fork_check() succeeded!\n");
+}
+
+/*Overview:
+    Called by the TLB miss handler when 'va' has no valid page table entry
+    in the page directory 'context'. Anonymous memory is created on first
+    touch: a read maps the shared zero page copy-on-write, and only a write
+    ('cause' says a TLBS miss) gets a private page right away. Pages of
+    the program image of `curenv` are loaded here too (see env_load_page),
+    and swapped-out pages are read back. When memory runs out, cold pages
+    are swapped out to make room (see swap_out_one).*/
+void pageout(int va, int context, u_int cause)
+{
+    int r;
     struct Page *p = NULL;
 
     if (context < 0x80000000) {
@@ -737,12 +1815,43 @@ void pageout(int va, int context)
         panic("^^^^^^TOO LOW^^^^^^^^^");
     }
 
-    if ((r = page_alloc(&p)) < 0) {
-        panic ("page alloc error!");
+    if ((r = swap_in((Pde *)context, va)) != -E_INVAL) {
+        if (r < 0) {
+            panic("pageout: can't swap in va %x: %d", va, r);
+        }
+        return;
     }
 
-    p->pp_ref++;
+    /* Pages of the program image are loaded on first touch. */
+    if (curenv != NULL && curenv->env_pgdir == (Pde *)context &&
+        (r = env_load_page(curenv, va)) != 0) {
+        if (r < 0) {
+            panic("pageout: can't load the program image");
+        }
+        return;
+    }
+
+    curenv_stats->es_zero_faults++;
+    if (((cause >> 2) & 0x1f) != EXC_TLBS) {
+        while ((r = page_insert((Pde *)context, zero_page, VA2PFN(va),
+                                PTE_COW | PTE_R)) == -E_NO_MEM &&
+               swap_out_one() == 0) {
+        }
+        if (r < 0) {
+            panic("page alloc error!");
+        }
+        return;
+    }
+
+    if ((r = swap_page_alloc(&p, PA_ZERO)) < 0) {
+        panic ("page alloc error!");
+    }
 
-    page_insert((Pde *)context, p, VA2PFN(va), PTE_R);
+    while ((r = page_insert((Pde *)context, p, VA2PFN(va), PTE_R)) == -E_NO_MEM &&
+           swap_out_one() == 0) {
+    }
+    if (r < 0) {
+        panic("page alloc error!");
+    }
     printf("pageout:\t@@@___0x%x___@@@  ins a page \n", va);
 }
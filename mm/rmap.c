@@ -0,0 +1,115 @@
+#include "mmu.h"
+#include "pmap.h"
+#include "printf.h"
+#include "error.h"
+#include "slab.h"
+#include "rmap.h"
+
+/* Reverse mappings: who maps each page. Pages marked PG_RESERVED (the
+ * zero page, program images) are mapped everywhere and never move, so
+ * they are not tracked. */
+static struct Kmem_cache *rmap_cache;
+static u_long rmap_pages;	// pages with at least one tracked mapping
+
+
+/* Overview:
+    Create the cache the nodes come from. One node is allocated and freed
+    right away: the cache keeps that slab (KMEM_EMPTY_KEEP), so the first
+    mappings don't depend on a free page being around. */
+void
+rmap_init(void)
+{
+    void *node;
+
+    rmap_cache = kmem_cache_create(sizeof(struct Rmap), sizeof(void *));
+    if (rmap_cache == NULL || (node = kmem_cache_alloc(rmap_cache)) == NULL) {
+        panic("rmap_init: can't set up the rmap cache");
+    }
+    kmem_cache_free(rmap_cache, node);
+}
+
+/* Overview:
+    Record that `pp` is mapped at `va` in `pgdir`.
+
+  Post-Condition:
+    Return 0 on success, or -E_NO_MEM. */
+int
+rmap_add(struct Page *pp, Pde *pgdir, u_long va)
+{
+    struct Rmap *rm;
+
+    if (pp->pp_flags & PG_RESERVED) {
+        return 0;
+    }
+    if ((rm = kmem_cache_alloc(rmap_cache)) == NULL) {
+        return -E_NO_MEM;
+    }
+
+    rm->rm_pgdir = pgdir;
+    rm->rm_va = ROUNDDOWN(va, BY2PG);
+    rm->rm_next = pp->pp_rmap;
+    if (pp->pp_rmap == NULL) {
+        rmap_pages++;
+    }
+    pp->pp_rmap = rm;
+    return 0;
+}
+
+/* Overview:
+    Forget the mapping of `pp` at `va` in `pgdir`, if it was recorded. */
+void
+rmap_del(struct Page *pp, Pde *pgdir, u_long va)
+{
+    struct Rmap **prm, *rm;
+
+    va = ROUNDDOWN(va, BY2PG);
+    for (prm = &pp->pp_rmap; (rm = *prm) != NULL; prm = &rm->rm_next) {
+        if (rm->rm_pgdir == pgdir && rm->rm_va == va) {
+            *prm = rm->rm_next;
+            kmem_cache_free(rmap_cache, rm);
+            if (pp->pp_rmap == NULL) {
+                rmap_pages--;
+            }
+            return;
+        }
+    }
+}
+
+/* Overview:
+    Call `fn` for every mapping of `pp`, stopping early if it returns
+    non-zero. `fn` may remove the mapping it's given, but no other.
+
+  Post-Condition:
+    Return what the last call of `fn` returned, or 0. */
+int
+rmap_for_each(struct Page *pp,
+              int (*fn)(struct Page *pp, Pde *pgdir, u_long va, void *arg),
+              void *arg)
+{
+    struct Rmap *rm, *next;
+    int r;
+
+    for (rm = pp->pp_rmap; rm != NULL; rm = next) {
+        next = rm->rm_next;
+        if ((r = fn(pp, rm->rm_pgdir, rm->rm_va, arg)) != 0) {
+            return r;
+        }
+    }
+    return 0;
+}
+
+/* Overview:
+    Print what the reverse map costs: its nodes, the slab pages holding
+    them, and the pp_rmap pointer every struct Page carries. */
+void
+rmap_report(void)
+{
+    u_int nodes = rmap_cache->kc_inuse;
+    u_int slabs = rmap_cache->kc_nslabs;
+
+    printf("rmap:\t%d mappings of %d pages, %d bytes of nodes in %d slab pages\n",
+           nodes, rmap_pages, nodes * rmap_cache->kc_size, slabs);
+    printf("rmap:\t%d bytes in all, with %d bytes of pp_rmap pointers\n",
+           slabs * BY2PG + npage * sizeof(struct Rmap *),
+           npage * sizeof(struct Rmap *));
+}
@@ -0,0 +1,267 @@
+#include "mmu.h"
+#include "pmap.h"
+#include "printf.h"
+#include "error.h"
+#include "slab.h"
+
+/* Caches come out of a static table. A destroyed cache leaves a slot with
+ * kc_size 0 behind, which the next kmem_cache_create takes. */
+static struct Kmem_cache kmem_caches[KMEM_CACHE_MAX];
+static int kmem_ncaches;		// slots ever used, the free ones included
+
+
+/* Overview:
+    Create a cache of objects of `size` bytes, each aligned to `align`
+    (a power of two, at least 4).
+
+  Post-Condition:
+    Return the new cache, or NULL if the table is full or an object
+    can't fit into a single slab page. */
+struct Kmem_cache *
+kmem_cache_create(u_int size, u_int align)
+{
+    struct Kmem_cache *cache;
+    int i;
+
+    if (align < sizeof(void *)) {
+        align = sizeof(void *);
+    }
+    for (i = 0; i < kmem_ncaches && kmem_caches[i].kc_size != 0; i++)
+        ;
+    if ((align & (align - 1)) != 0 || i >= KMEM_CACHE_MAX) {
+        return NULL;
+    }
+
+    /* Step 1: Work out the slab layout: header first, then as many
+     * objects as fit in the rest of the page. */
+    size = ROUND(size < sizeof(void *) ? sizeof(void *) : size, align);
+    if (ROUND(sizeof(struct Slab), align) + size > BY2PG) {
+        return NULL;
+    }
+
+    cache = &kmem_caches[i];
+    if (i == kmem_ncaches) {
+        kmem_ncaches++;
+    }
+    cache->kc_size = size;
+    cache->kc_align = align;
+    cache->kc_offset = ROUND(sizeof(struct Slab), align);
+    cache->kc_per_slab = (BY2PG - cache->kc_offset) / size;
+
+    /* Step 2: Start out with no slab at all. */
+    LIST_INIT(&cache->kc_partial);
+    LIST_INIT(&cache->kc_full);
+    LIST_INIT(&cache->kc_empty);
+    cache->kc_nslabs = 0;
+    cache->kc_nempty = 0;
+    cache->kc_inuse = 0;
+    return cache;
+}
+
+/* Overview:
+    Destroy `cache`, which must have no object handed out: its slabs go
+    back to the page allocator and its table slot can be reused. */
+void
+kmem_cache_destroy(struct Kmem_cache *cache)
+{
+    struct Slab *slab;
+
+    if (cache->kc_inuse != 0) {
+        panic("kmem_cache_destroy: %d objects still in use", cache->kc_inuse);
+    }
+    while ((slab = LIST_FIRST(&cache->kc_empty)) != NULL) {
+        LIST_REMOVE(slab, sl_link);
+        page_decref(pa2page(PADDR(slab)));
+    }
+    cache->kc_size = 0;
+    cache->kc_nslabs = 0;
+    cache->kc_nempty = 0;
+}
+
+/* Overview:
+    Get a page from page_alloc and lay it out as an empty slab of `cache`.
+
+  Post-Condition:
+    Return the slab, or NULL if we're out of memory. */
+static struct Slab *
+kmem_slab_grow(struct Kmem_cache *cache)
+{
+    struct Page *pp;
+    struct Slab *slab;
+    u_long obj;
+    u_int i;
+
+    /* Every byte we use is written below, no need for a cleared page. */
+    if (page_alloc_flags(&pp, PA_NOZERO) < 0) {
+        return NULL;
+    }
+    pp->pp_ref++;
+
+    slab = (struct Slab *)page2kva(pp);
+    slab->sl_cache = cache;
+    slab->sl_inuse = 0;
+    slab->sl_free = NULL;
+
+    /* Chain the objects back to front so the first one comes out first. */
+    for (i = cache->kc_per_slab; i > 0; i--) {
+        obj = (u_long)slab + cache->kc_offset + (i - 1) * cache->kc_size;
+        *(void **)obj = slab->sl_free;
+        slab->sl_free = (void *)obj;
+    }
+
+    LIST_INSERT_HEAD(&cache->kc_empty, slab, sl_link);
+    cache->kc_nslabs++;
+    cache->kc_nempty++;
+    return slab;
+}
+
+/* Overview:
+    Allocate an object from `cache`. Partially used slabs are filled first,
+    so empty slabs stay empty and can be given back.
+
+  Post-Condition:
+    Return the object (NOT cleared), or NULL if we're out of memory. */
+void *
+kmem_cache_alloc(struct Kmem_cache *cache)
+{
+    struct Slab *slab;
+    void *obj;
+
+    /* Step 1: Pick a slab with a free object, growing the cache if needed. */
+    if ((slab = LIST_FIRST(&cache->kc_partial)) == NULL) {
+        if ((slab = LIST_FIRST(&cache->kc_empty)) == NULL &&
+            (slab = kmem_slab_grow(cache)) == NULL) {
+            return NULL;
+        }
+        LIST_REMOVE(slab, sl_link);
+        cache->kc_nempty--;
+        LIST_INSERT_HEAD(&cache->kc_partial, slab, sl_link);
+    }
+
+    /* Step 2: Take its first free object. */
+    obj = slab->sl_free;
+    slab->sl_free = *(void **)obj;
+    slab->sl_inuse++;
+    cache->kc_inuse++;
+
+    /* Step 3: Move the slab to the full list if that was its last one. */
+    if (slab->sl_inuse == cache->kc_per_slab) {
+        LIST_REMOVE(slab, sl_link);
+        LIST_INSERT_HEAD(&cache->kc_full, slab, sl_link);
+    }
+    return obj;
+}
+
+/* Overview:
+    Give `obj` back to `cache`. Once more than KMEM_EMPTY_KEEP slabs are
+    empty, the page of this one goes back to the page allocator. */
+void
+kmem_cache_free(struct Kmem_cache *cache, void *obj)
+{
+    struct Slab *slab;
+
+    /* Step 1: The slab header lives at the start of the object's page. */
+    slab = (struct Slab *)ROUNDDOWN(obj, BY2PG);
+    if (slab->sl_cache != cache) {
+        panic("kmem_cache_free: %x does not belong to this cache", obj);
+    }
+
+    /* Step 2: A full slab becomes partial again ... */
+    if (slab->sl_inuse == cache->kc_per_slab) {
+        LIST_REMOVE(slab, sl_link);
+        LIST_INSERT_HEAD(&cache->kc_partial, slab, sl_link);
+    }
+
+    *(void **)obj = slab->sl_free;
+    slab->sl_free = obj;
+    slab->sl_inuse--;
+    cache->kc_inuse--;
+
+    if (slab->sl_inuse > 0) {
+        return;
+    }
+
+    /* Step 3: ... and a partial one becomes empty, or is released. */
+    LIST_REMOVE(slab, sl_link);
+    if (cache->kc_nempty < KMEM_EMPTY_KEEP) {
+        LIST_INSERT_HEAD(&cache->kc_empty, slab, sl_link);
+        cache->kc_nempty++;
+        return;
+    }
+    cache->kc_nslabs--;
+    page_decref(pa2page(PADDR(slab)));
+}
+
+/* Overview:
+    Print the utilization of every cache: objects handed out against the
+    room its slabs have. */
+void
+kmem_cache_dump(void)
+{
+    struct Kmem_cache *cache;
+    u_int room;
+    int i;
+
+    printf("slab:\tsize align slabs inuse/room util\n");
+    for (i = 0; i < kmem_ncaches; i++) {
+        cache = &kmem_caches[i];
+        if (cache->kc_size == 0) {
+            continue;
+        }
+        room = cache->kc_nslabs * cache->kc_per_slab;
+        printf("slab:\t%4d %5d %5d %5d/%-4d %3d%%\n",
+               cache->kc_size, cache->kc_align, cache->kc_nslabs,
+               cache->kc_inuse, room,
+               room ? cache->kc_inuse * 100 / room : 0);
+    }
+}
+
+void
+kmem_cache_check(void)
+{
+    struct Kmem_cache *cache;
+    struct Page *pp;
+    void **obj;
+    u_int n, per, i;
+
+    // 20 byte objects aligned to 8 take 24 bytes each
+    cache = kmem_cache_create(20, 8);
+    assert(cache != NULL);
+    assert(cache->kc_size == 24);
+    per = cache->kc_per_slab;
+    assert(per > 0 && per * 24 + cache->kc_offset <= BY2PG);
+
+    // fill a bit more than two slabs
+    n = 2 * per + 1;
+    assert(n * sizeof(void *) <= BY2PG);
+    assert(page_alloc(&pp) == 0);
+    obj = (void **)page2kva(pp);
+    for (i = 0; i < n; i++) {
+        obj[i] = kmem_cache_alloc(cache);
+        assert(obj[i] != NULL);
+        assert(((u_long)obj[i] & 7) == 0);
+        assert(i == 0 || obj[i] != obj[i - 1]);
+    }
+    assert(cache->kc_nslabs == 3);
+    assert(cache->kc_inuse == n);
+
+    // a freed object is handed out again first
+    kmem_cache_free(cache, obj[5]);
+    assert(kmem_cache_alloc(cache) == obj[5]);
+
+    // emptying every slab keeps KMEM_EMPTY_KEEP of them and frees the rest
+    for (i = 0; i < n; i++) {
+        kmem_cache_free(cache, obj[i]);
+    }
+    assert(cache->kc_inuse == 0);
+    assert(cache->kc_nslabs == KMEM_EMPTY_KEEP);
+
+    kmem_cache_dump();
+    page_free(pp);
+
+    // destroying it frees its slot for the next cache
+    kmem_cache_destroy(cache);
+    assert(kmem_cache_create(20, 8) == cache);
+    kmem_cache_destroy(cache);
+    printf("kmem_cache_check() succeeded!\n");
+}
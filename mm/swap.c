@@ -0,0 +1,262 @@
+#include "mmu.h"
+#include "pmap.h"
+#include "printf.h"
+#include "error.h"
+#include "rmap.h"
+#include "swap.h"
+#include "env.h"
+
+/* Slot n of the swap area is in use iff bit n is set. */
+static u_int swap_bitmap[SWAP_NSLOTS / 32];
+static u_int swap_next;			// where the next slot search starts
+static u_long swap_hand;		// the clock hand, a page number
+static struct Swap_stats swap_stat;
+static int swap_on;			// the swap disk is there (swap_init)
+
+
+/* Overview:
+    Look for the swap disk by reading the last sector of the swap area.
+    Without it nothing is ever swapped out, and running out of memory
+    fails with -E_NO_MEM as it would with no swapping at all. */
+void
+swap_init(void)
+{
+    static u_int sect[SECT_SIZE / 4];
+
+    swap_on = ide_read(SWAP_DISKNO, SWAP_NSLOTS * SECT2PG - 1, sect, 1) == 0;
+    printf("swap_init:\t%s\n", swap_on ? "swap disk found" : "no swap disk, swapping is off");
+}
+
+/* Overview:
+    Take a free swap slot.
+
+  Post-Condition:
+    Return the slot, or -E_NO_DISK if the swap area is full. */
+static int
+swap_slot_alloc(void)
+{
+    u_int i, slot;
+
+    for (i = 0; i < SWAP_NSLOTS; i++) {
+        slot = (swap_next + i) % SWAP_NSLOTS;
+        if (!(swap_bitmap[slot >> 5] & (1 << (slot & 31)))) {
+            swap_bitmap[slot >> 5] |= 1 << (slot & 31);
+            swap_next = slot + 1;
+            swap_stat.ss_used++;
+            return slot;
+        }
+    }
+    return -E_NO_DISK;
+}
+
+static void
+swap_slot_free(u_int slot)
+{
+    if (slot >= SWAP_NSLOTS || !(swap_bitmap[slot >> 5] & (1 << (slot & 31)))) {
+        panic("swap_slot_free: slot %d isn't in use", slot);
+    }
+    swap_bitmap[slot >> 5] &= ~(1 << (slot & 31));
+    swap_stat.ss_used--;
+}
+
+/* Overview:
+    Write the page `pp`, mapped only at `va` in `pgdir`, to a swap slot,
+    and turn its PTE into a PTE_SWAP entry holding the slot. The page is
+    freed.
+
+  Post-Condition:
+    Return 0 on success, -E_NO_DISK if the swap area is full, or
+    -E_UNSPECIFIED if the disk can't be written. */
+static int
+swap_out(struct Page *pp, Pde *pgdir, u_long va)
+{
+    Pte *pte;
+    int slot;
+
+    if ((slot = swap_slot_alloc()) < 0) {
+        return slot;
+    }
+    if (ide_write(SWAP_DISKNO, slot * SECT2PG, (void *)page2kva(pp), SECT2PG) < 0) {
+        swap_slot_free(slot);
+        return -E_UNSPECIFIED;
+    }
+
+    /* The PTE stays counted in pi_count, so its table is kept. */
+    pgdir_walk(pgdir, va, 0, &pte);
+    *pte = (slot << PGSHIFT) | (*pte & 0xfff & ~PTE_V) | PTE_SWAP;
+    tlb_invalidate(pgdir, va);
+    rmap_del(pp, pgdir, va);
+    page_decref(pp);
+    swap_stat.ss_outs++;
+    return 0;
+}
+
+/* Overview:
+    Move the clock hand over pages[] until it finds a victim, and swap it
+    out. Only user pages with a single mapping (pp_ref 1, one rmap) are
+    considered, so a slot never has more than one PTE pointing to it.
+
+    The R3000 keeps no referenced bit, so a page counts as referenced when
+    its mapping is in the TLB: the hand drops that entry (tlb_test_and_clear)
+    and moves on, and takes the page the next time round unless it was
+    touched again meanwhile.
+
+  Post-Condition:
+    Return 0 if a page was freed, or -E_NO_MEM if there's nothing to swap. */
+int
+swap_out_one(void)
+{
+    struct Page_stats st;
+    struct Page *pp;
+    struct Rmap *rm;
+    u_long carved, n;
+
+    if (!swap_on) {
+        return -E_NO_MEM;
+    }
+
+    /* Pages past the carved part have never been handed out. */
+    page_stats(&st);
+    carved = st.ps_total - st.ps_uncarved;
+
+    for (n = 0; n < 2 * carved; n++) {
+        if (swap_hand >= carved) {
+            swap_hand = 0;
+        }
+        pp = &pages[swap_hand++];
+        swap_stat.ss_scans++;
+
+        rm = pp->pp_rmap;
+        if (rm == NULL || rm->rm_next != NULL || pp->pp_ref != 1 ||
+            (pp->pp_flags & PG_RESERVED)) {
+            continue;
+        }
+        if (tlb_test_and_clear(rm->rm_pgdir, rm->rm_va)) {
+            continue;
+        }
+        if (swap_out(pp, rm->rm_pgdir, rm->rm_va) == 0) {
+            return 0;
+        }
+        break;
+    }
+    return -E_NO_MEM;
+}
+
+/* Overview:
+    Bring back the page swapped out at `va` in `pgdir`.
+
+  Post-Condition:
+    Return 0 on success, -E_INVAL if `va` isn't swapped out, -E_NO_MEM, or
+    -E_UNSPECIFIED if the disk can't be read. The slot is kept then. */
+int
+swap_in(Pde *pgdir, u_long va)
+{
+    struct Page *pp;
+    Pte *pte;
+    u_int slot;
+    int r;
+
+    va = ROUNDDOWN(va, BY2PG);
+    if (pgdir_walk(pgdir, va, 0, &pte) < 0 || pte == 0 || !(*pte & PTE_SWAP)) {
+        return -E_INVAL;
+    }
+    slot = SWAP_SLOT(*pte);
+
+    /* Making room can't touch this PTE: it maps no page. */
+    if ((r = swap_page_alloc(&pp, PA_NOZERO)) < 0) {
+        return r;
+    }
+    if ((r = rmap_add(pp, pgdir, va)) < 0) {
+        page_free(pp);
+        return r;
+    }
+    if (ide_read(SWAP_DISKNO, slot * SECT2PG, (void *)page2kva(pp), SECT2PG) < 0) {
+        rmap_del(pp, pgdir, va);
+        page_free(pp);
+        return -E_UNSPECIFIED;
+    }
+
+    /* An invalid PTE has no TLB entry, nothing to invalidate. */
+    *pte = page2pa(pp) | (*pte & 0xfff & ~PTE_SWAP) | PTE_V;
+    pp->pp_ref++;
+    swap_slot_free(slot);
+    swap_stat.ss_ins++;
+    return 0;
+}
+
+/* Overview:
+    Release the slot of the PTE_SWAP entry `pte`, which is being cleared. */
+void
+swap_drop(Pte pte)
+{
+    swap_slot_free(SWAP_SLOT(pte));
+}
+
+/* Overview:
+    page_alloc_flags, swapping pages out for as long as memory is short.
+
+  Post-Condition:
+    Return 0 on success, or -E_NO_MEM if nothing is left to swap out. */
+int
+swap_page_alloc(struct Page **pp, int flags)
+{
+    int r;
+
+    while ((r = page_alloc_flags(pp, flags)) == -E_NO_MEM) {
+        if (swap_out_one() < 0) {
+            break;
+        }
+    }
+    return r;
+}
+
+void
+swap_stats(struct Swap_stats *st)
+{
+    *st = swap_stat;
+}
+
+void
+swap_check(void)
+{
+    struct Env *e;
+    struct Page *pp;
+    struct Swap_stats st;
+    Pte *pte;
+    u_long va = 0x00400000;
+    u_int i;
+
+    if (!swap_on) {
+        printf("swap_check() skipped: no swap disk\n");
+        return;
+    }
+
+    assert(env_alloc(&e, 0) == 0);
+    assert(page_alloc(&pp) == 0);
+    assert(page_insert(e->env_pgdir, pp, va, PTE_R) == 0);
+    for (i = 0; i < BY2PG / 4; i++) {
+        ((u_int *)page2kva(pp))[i] = i * 0x9e3779b9;
+    }
+    st = swap_stat;
+
+    // out: the PTE keeps the slot, and the page is gone
+    assert(swap_out(pp, e->env_pgdir, va) == 0);
+    assert(pp->pp_ref == 0 && pp->pp_rmap == NULL);
+    assert(page_lookup(e->env_pgdir, va, &pte) == NULL);
+    assert(pgdir_walk(e->env_pgdir, va, 0, &pte) == 0 && pte != 0);
+    assert((*pte & PTE_SWAP) && !(*pte & PTE_V) && (*pte & PTE_R));
+    assert(swap_stat.ss_used == st.ss_used + 1 && swap_stat.ss_outs == st.ss_outs + 1);
+
+    // and back in, with the same contents and permissions
+    assert(swap_in(e->env_pgdir, va) == 0);
+    assert((pp = page_lookup(e->env_pgdir, va, &pte)) != NULL);
+    assert((*pte & PTE_V) && (*pte & PTE_R) && !(*pte & PTE_SWAP));
+    for (i = 0; i < BY2PG / 4; i++) {
+        assert(((u_int *)page2kva(pp))[i] == i * 0x9e3779b9);
+    }
+    assert(swap_stat.ss_used == st.ss_used && swap_stat.ss_ins == st.ss_ins + 1);
+    assert(swap_in(e->env_pgdir, va) == -E_INVAL);
+
+    env_free(e);
+    printf("swap_check() succeeded!\n");
+}